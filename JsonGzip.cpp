@@ -0,0 +1,183 @@
+//
+// gzip输入的流式解析，只有使用JsonParser::streamGzip时才需要编译此文件并链接zlib与pthread.
+//
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <stdexcept>
+#include <system_error>
+#include <zlib.h>
+#include "JsonParser.h"
+
+/*
+ * gzip解压流水线：生产者线程把in解压到slots个chunkSize大小的缓冲区组成的环中，
+ * 消费者（JsonStream的读取回调）从环中依次取出，两者在两个核上并行，内存占用固定.
+ * 支持多个gzip member首尾相接的文件，也接受zlib格式.
+ */
+class GzipRing {
+public:
+    GzipRing(std::shared_ptr<std::istream> in, size_t chunkSize, size_t slots)
+            : in_(std::move(in)), chunkSize_(chunkSize), slots_(std::max<size_t>(slots, 2)) {
+        for (auto &slot : slots_)
+            slot.data.resize(chunkSize_);
+        thread_ = std::thread(&GzipRing::produce, this);
+    }
+
+    // 消费者提前放弃时也要让生产者退出.
+    ~GzipRing() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        notFull_.notify_all();
+        thread_.join();
+    }
+
+    size_t read(char *buf, size_t len) {
+        Slot *slot;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            notEmpty_.wait(lock, [this] { return filled_ > 0 || done_; });
+            if (filled_ == 0) {
+                if (error_)
+                    std::rethrow_exception(error_);
+                return 0;
+            }
+            slot = &slots_[head_];
+        }
+        // 已填满的slot只归消费者访问，拷贝时无需持锁
+        size_t n = std::min(len, slot->size - offset_);
+        memcpy(buf, slot->data.data() + offset_, n);
+        offset_ += n;
+        if (offset_ == slot->size) {
+            offset_ = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                head_ = (head_ + 1) % slots_.size();
+                --filled_;
+            }
+            notFull_.notify_one();
+        }
+        return n;
+    }
+
+private:
+    struct Slot {
+        std::vector<char> data;
+        size_t size = 0;
+    };
+
+    void produce() {
+        z_stream zs{};
+        if (inflateInit2(&zs, 15 + 32) != Z_OK) { // 15 + 32：自动识别gzip与zlib头
+            finish(std::make_exception_ptr(std::runtime_error("inflateInit failed.")));
+            return;
+        }
+        std::vector<char> input(chunkSize_);
+        bool inputEnded = false;
+        bool memberEnded = false; // 刚好停在两个member之间
+        try {
+            for (;;) {
+                Slot *slot;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    notFull_.wait(lock, [this] { return filled_ < slots_.size() || stop_; });
+                    if (stop_)
+                        break;
+                    slot = &slots_[tail_];
+                }
+                slot->size = 0;
+                bool finished = false;
+                while (slot->size < slot->data.size()) {
+                    if (zs.avail_in == 0 && !inputEnded) {
+                        in_->read(input.data(), static_cast<std::streamsize>(input.size()));
+                        if (in_->bad())
+                            throw std::ios_base::failure("read failed.");
+                        zs.next_in = reinterpret_cast<Bytef *>(input.data());
+                        zs.avail_in = static_cast<uInt>(in_->gcount());
+                        inputEnded = zs.avail_in == 0;
+                    }
+                    if (zs.avail_in == 0) {
+                        if (!memberEnded)
+                            throw std::runtime_error("unexpected end of compressed input.");
+                        finished = true;
+                        break;
+                    }
+                    zs.next_out = reinterpret_cast<Bytef *>(slot->data.data() + slot->size);
+                    zs.avail_out = static_cast<uInt>(slot->data.size() - slot->size);
+                    int ret = inflate(&zs, Z_NO_FLUSH);
+                    slot->size = slot->data.size() - zs.avail_out;
+                    if (ret == Z_STREAM_END) {
+                        memberEnded = true;
+                        inflateReset(&zs);
+                    } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+                        memberEnded = false;
+                    } else {
+                        throw std::runtime_error(std::string("inflate failed: ") + (zs.msg ? zs.msg : "unknown error"));
+                    }
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (slot->size > 0) {
+                        tail_ = (tail_ + 1) % slots_.size();
+                        ++filled_;
+                    }
+                }
+                notEmpty_.notify_one();
+                if (finished)
+                    break;
+            }
+            inflateEnd(&zs);
+            finish(nullptr);
+        } catch (...) {
+            inflateEnd(&zs);
+            finish(std::current_exception());
+        }
+    }
+
+    void finish(std::exception_ptr error) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            error_ = std::move(error);
+            done_ = true;
+        }
+        notEmpty_.notify_all();
+    }
+
+    std::shared_ptr<std::istream> in_;
+    size_t chunkSize_;
+    std::vector<Slot> slots_;
+    size_t head_ = 0; // 消费者正在读取的slot
+    size_t offset_ = 0; // 消费者在head_中已读取的字节数
+    size_t tail_ = 0; // 生产者正在写入的slot
+    size_t filled_ = 0; // 已填满、等待消费的slot数
+    bool done_ = false;
+    bool stop_ = false;
+    std::exception_ptr error_;
+    std::mutex mutex_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+    std::thread thread_; // 最后初始化，此时其余成员均已构造完成
+};
+
+JsonStream JsonParser::streamGzip(std::istream &in, size_t chunkSize, size_t ringSize) {
+    // 不拥有in，调用者须保证其在遍历期间有效
+    std::shared_ptr<std::istream> source(&in, [](std::istream *) {});
+    auto ring = std::make_shared<GzipRing>(std::move(source), chunkSize, ringSize);
+    return streamFrom([ring](char *buf, size_t len) {
+        return ring->read(buf, len);
+    }, chunkSize);
+}
+
+JsonStream JsonParser::streamGzip(const std::string &path, size_t chunkSize, size_t ringSize) {
+    auto file = std::make_shared<std::ifstream>(path, std::ios::binary);
+    if (!*file)
+        throw std::system_error(errno, std::generic_category(), "cannot open " + path);
+    auto ring = std::make_shared<GzipRing>(std::move(file), chunkSize, ringSize);
+    return streamFrom([ring](char *buf, size_t len) {
+        return ring->read(buf, len);
+    }, chunkSize);
+}
@@ -5,6 +5,43 @@
 #include "JsonParser.h"
 
 #include <utility>
+#include <cstring>
+#include <charconv>
+#include <cmath>
+#include <mutex>
+
+JKey::JKey() : entry_(empty()) {}
+
+const std::shared_ptr<const JKey::Entry> &JKey::empty() noexcept {
+    static const auto entry = std::make_shared<const Entry>(Entry{std::string(), Hash()(std::string_view())});
+    return entry;
+}
+
+JKey::JKey(std::string_view str) : entry_(std::make_shared<const Entry>(Entry{std::string(str), Hash()(str)})) {}
+
+JsonKeyTable::JsonKeyTable(size_t capacity) : capacity_(capacity) {}
+
+JKey JsonKeyTable::intern(std::string_view str) {
+    {
+        std::shared_lock lock(mutex_);
+        auto iter = keys_.find(str);
+        if (iter != keys_.end())
+            return iter->second;
+        if (keys_.size() >= capacity_)
+            return JKey(str);
+    }
+    std::unique_lock lock(mutex_);
+    if (keys_.size() >= capacity_)
+        return JKey(str);
+    JKey key(str);
+    // try_emplace在另一个线程抢先插入时返回已有的key
+    return keys_.try_emplace(key.str(), key).first->second;
+}
+
+size_t JsonKeyTable::size() const {
+    std::shared_lock lock(mutex_);
+    return keys_.size();
+}
 
 JElement::JType JObject::type() {
     return JType::JOBJECT;
@@ -18,28 +55,49 @@ std::string JObject::toJson() {
             jsonStr += ",";
         else
             first = false;
-        jsonStr += "\"" + pair.first;
+        jsonStr += "\"" + pair.first.str();
         jsonStr += "\":" + pair.second->toJson();
     }
     jsonStr += "}";
     return jsonStr;
 }
 
-std::shared_ptr<JElement> JObject::getElement(const std::string &key) {
+std::shared_ptr<JElement> JObject::getElement(std::string_view key) {
     auto iter = objectValue_.find(key);
     if (iter == objectValue_.end())
         throw std::out_of_range("key not found.");
     return iter->second;
 }
 
-auto JObject::getMultiElements(const std::string &key) {
+std::shared_ptr<JElement> JObject::getElement(const JKey &key) {
+    auto iter = objectValue_.find(key);
+    if (iter == objectValue_.end())
+        throw std::out_of_range("key not found.");
+    return iter->second;
+}
+
+JElement *JObject::findElement(std::string_view key) const {
+    auto iter = objectValue_.find(key);
+    return iter == objectValue_.end() ? nullptr : iter->second.get();
+}
+
+JElement *JObject::findElement(const JKey &key) const {
+    auto iter = objectValue_.find(key);
+    return iter == objectValue_.end() ? nullptr : iter->second.get();
+}
+
+std::pair<JObject::const_iterator, JObject::const_iterator> JObject::getMultiElements(std::string_view key) const {
     auto pair_iter = objectValue_.equal_range(key);
-    if (pair_iter.first == objectValue_.end())
+    if (pair_iter.first == pair_iter.second)
         throw std::out_of_range("key not found.");
     return pair_iter;
 }
 
-bool JObject::hasKey(const std::string &key) const {
+bool JObject::hasKey(std::string_view key) const {
+    return objectValue_.contains(key);
+}
+
+bool JObject::hasKey(const JKey &key) const {
     return objectValue_.contains(key);
 }
 
@@ -47,12 +105,57 @@ size_t JObject::size() const {
     return objectValue_.size();
 }
 
-auto JObject::pairs() const {
+const JObject::Map &JObject::pairs() const {
     return objectValue_;
 }
 
+JObject::const_iterator JObject::begin() const {
+    return objectValue_.begin();
+}
+
+JObject::const_iterator JObject::end() const {
+    return objectValue_.end();
+}
+
 void JObject::addElement(const std::string &key, std::shared_ptr<JElement> e) {
-    objectValue_.insert({key, std::move(e)});
+    addElement(JKey(key), std::move(e));
+}
+
+void JObject::addElement(JKey key, std::shared_ptr<JElement> e) {
+    hashCached_ = false;
+    objectValue_.emplace(std::move(key), std::move(e));
+}
+
+void JObject::setElement(std::string_view key, std::shared_ptr<JElement> e) {
+    auto range = objectValue_.equal_range(key);
+    if (range.first == range.second) {
+        addElement(JKey(key), std::move(e));
+        return;
+    }
+    hashCached_ = false;
+    range.first->second = std::move(e);
+    objectValue_.erase(std::next(range.first), range.second);
+}
+
+void JObject::setElement(JKey key, std::shared_ptr<JElement> e) {
+    auto range = objectValue_.equal_range(key);
+    if (range.first == range.second) {
+        addElement(std::move(key), std::move(e));
+        return;
+    }
+    hashCached_ = false;
+    range.first->second = std::move(e);
+    objectValue_.erase(std::next(range.first), range.second);
+}
+
+size_t JObject::removeElement(std::string_view key) {
+    auto range = objectValue_.equal_range(key);
+    size_t count = std::distance(range.first, range.second);
+    if (count > 0) {
+        hashCached_ = false;
+        objectValue_.erase(range.first, range.second);
+    }
+    return count;
 }
 
 JElement::JType JArray::type() {
@@ -78,25 +181,57 @@ std::shared_ptr<JElement> JArray::getElement(size_t index) const {
     return std::shared_ptr<JElement>(arrayValue_.at(index));
 }
 
+const std::shared_ptr<JElement> &JArray::at(size_t index) const {
+    return arrayValue_.at(index);
+}
+
+const std::vector<std::shared_ptr<JElement>> &JArray::elements() const {
+    return arrayValue_;
+}
+
+JArray::const_iterator JArray::begin() const {
+    return arrayValue_.begin();
+}
+
+JArray::const_iterator JArray::end() const {
+    return arrayValue_.end();
+}
+
 void JArray::setElement(size_t index, std::shared_ptr<JElement> e) {
     arrayValue_.at(index) = std::move(e);
+    hashCached_ = false;
 }
 
 void JArray::removeElement(size_t index) {
     arrayValue_.at(index);
     arrayValue_.erase(arrayValue_.begin() + index);
+    hashCached_ = false;
 }
 
 void JArray::addElement(std::shared_ptr<JElement> e) {
+    hashCached_ = false;
     arrayValue_.push_back(std::move(e));
 }
 
+void JArray::insertElement(size_t index, std::shared_ptr<JElement> e) {
+    if (index > arrayValue_.size())
+        throw std::out_of_range("index out of range.");
+    hashCached_ = false;
+    arrayValue_.insert(arrayValue_.begin() + index, std::move(e));
+}
+
 JElement::JType JString::type() {
     return JElement::JType::JSTRING;
 }
 
 std::string JString::toJson() {
-    return '"' + strValue_ + '"';
+    std::string_view str = getView();
+    std::string jsonStr;
+    jsonStr.reserve(str.size() + 2);
+    jsonStr += '"';
+    jsonStr += str;
+    jsonStr += '"';
+    return jsonStr;
 }
 
 JString::JString(const char *s, size_t len) : strValue_(s, len) {}
@@ -105,7 +240,26 @@ JString::JString(const char *s, size_t len) : strValue_(s, len) {}
 JString::JString(std::string str) : strValue_(std::move(str)) {}
 
 std::string JString::getStr() const {
-    return strValue_;
+    return std::string(getView());
+}
+
+// JString::NewView创建的节点，继承来的strValue_为空
+class JStringView : public JString {
+public:
+    JStringView(std::string_view str, std::shared_ptr<const void> owner)
+            : JString(std::string()), view_(str), owner_(std::move(owner)) {}
+
+    std::string_view getView() const override {
+        return view_;
+    }
+
+private:
+    std::string_view view_;
+    std::shared_ptr<const void> owner_;
+};
+
+std::shared_ptr<JString> JString::NewView(std::string_view str, std::shared_ptr<const void> owner) {
+    return std::make_shared<JStringView>(str, std::move(owner));
 }
 
 JElement::JType JTrue::type() {
@@ -139,6 +293,12 @@ std::string JElement::getAsString() {
     return js->getStr();
 }
 
+std::string_view JElement::getAsStringView() {
+    if (!isJString())
+        throw std::bad_cast();
+    return static_cast<JString *>(this)->getView();
+}
+
 double JElement::getAsDouble() {
     JNumber* jn = dynamic_cast<JNumber*>(this);
     if (!jn)
@@ -146,6 +306,13 @@ double JElement::getAsDouble() {
     return jn->getDouble();
 }
 
+int64_t JElement::getAsInt64() {
+    JNumber* jn = dynamic_cast<JNumber*>(this);
+    if (!jn)
+        throw std::bad_cast();
+    return jn->getInt64();
+}
+
 bool JElement::getAsBoolean() {
     if (isJFalse())
         return false;
@@ -168,6 +335,18 @@ std::shared_ptr<JObject> JElement::getAsObject() {
     return jo;
 }
 
+JArray &JElement::getAsArrayRef() {
+    if (!isJArray())
+        throw std::bad_cast();
+    return *static_cast<JArray *>(this);
+}
+
+JObject &JElement::getAsObjectRef() {
+    if (!isJObject())
+        throw std::bad_cast();
+    return *static_cast<JObject *>(this);
+}
+
 JElement::JType JNumber::type() {
     return JType::JNUMBER;
 }
@@ -184,3 +363,703 @@ double JNumber::getDouble() const {
     return numberValue_;
 }
 
+int64_t JNumber::getInt64() const {
+    double n = getDouble();
+    // 2^63可以精确表示为double，[-2^63, 2^63)内的整数都能转换
+    if (n != std::floor(n) || n < -9223372036854775808.0 || n >= 9223372036854775808.0)
+        throw std::out_of_range("number is not an int64.");
+    return static_cast<int64_t>(n);
+}
+
+bool JNumber::hasRaw() const {
+    return false;
+}
+
+std::string_view JNumber::getRaw() const {
+    return std::string_view();
+}
+
+namespace {
+
+/*
+ * 原文(已校验)的精确值是int64范围内的整数时写入out并返回true.
+ * "100"、"100.0"、"1e2"、"10000e-2"得到同一个值，不经过double，因此超过2^53也不会丢失精度.
+ */
+bool exactInt64(std::string_view raw, int64_t &out) {
+    if (raw.find_first_of(".eE") == std::string_view::npos)
+        return std::from_chars(raw.data(), raw.data() + raw.size(), out).ec == std::errc();
+    size_t i = 0;
+    bool negative = raw[0] == '-';
+    if (negative)
+        i++;
+    std::string digits; // 整数部分与小数部分拼接后的全部数字，值为digits * 10^exponent
+    long exponent = 0;
+    for (; i < raw.size() && raw[i] >= '0' && raw[i] <= '9'; i++)
+        digits += raw[i];
+    if (i < raw.size() && raw[i] == '.') {
+        for (++i; i < raw.size() && raw[i] >= '0' && raw[i] <= '9'; i++, exponent--)
+            digits += raw[i];
+    }
+    if (i < raw.size() && (raw[i] == 'e' || raw[i] == 'E')) {
+        bool negativeExponent = raw[++i] == '-';
+        if (raw[i] == '-' || raw[i] == '+')
+            i++;
+        long e = 0;
+        for (; i < raw.size(); i++)
+            e = std::min(e * 10 + (raw[i] - '0'), 1000000L); // 饱和，远超int64所需的位数即可
+        exponent += negativeExponent ? -e : e;
+    }
+    size_t first = digits.find_first_not_of('0');
+    if (first == std::string::npos) {
+        out = 0;
+        return true;
+    }
+    size_t last = digits.find_last_not_of('0');
+    exponent += static_cast<long>(digits.size() - 1 - last);
+    if (exponent < 0 || static_cast<long>(last - first + 1) + exponent > 19)
+        return false;
+    std::string canonical = negative ? "-" : "";
+    canonical.append(digits, first, last - first + 1);
+    canonical.append(exponent, '0');
+    auto result = std::from_chars(canonical.data(), canonical.data() + canonical.size(), out);
+    return result.ec == std::errc();
+}
+
+}
+
+// JNumber::NewRaw/NewRawView创建的节点的公共部分，每次读取都从raw_转换，不缓存以便共享的文档可以并发读取
+class JRawNumber : public JNumber {
+public:
+    JRawNumber(const JRawNumber &) = delete;
+
+    JRawNumber &operator=(const JRawNumber &) = delete;
+
+    std::string toJson() override {
+        return std::string(raw_);
+    }
+
+    double getDouble() const override {
+        // 原文已由解析器校验过，且上溢在解析时已报错，下溢时from_chars不修改n，此时结果为0
+        double n = 0;
+        std::from_chars(raw_.data(), raw_.data() + raw_.size(), n);
+        return n;
+    }
+
+    int64_t getInt64() const override {
+        int64_t n = 0;
+        if (exactInt64(raw_, n))
+            return n;
+        if (raw_.find_first_of(".eE") == std::string_view::npos)
+            throw std::out_of_range("number out of int64 range.");
+        return JNumber::getInt64();
+    }
+
+    bool hasRaw() const override {
+        return true;
+    }
+
+    std::string_view getRaw() const override {
+        return raw_;
+    }
+
+protected:
+    JRawNumber() : JNumber(0.0) {}
+
+    std::string_view raw_; // 指向派生类持有的存储
+};
+
+// 原文不超过INLINE_SIZE时存放在节点内(19位的int64 ID也放得下)，否则单独分配
+class JOwnedRawNumber : public JRawNumber {
+public:
+    static constexpr size_t INLINE_SIZE = 32;
+
+    explicit JOwnedRawNumber(std::string_view raw) {
+        char *data = inline_;
+        if (raw.size() > INLINE_SIZE) {
+            heap_ = std::make_unique<char[]>(raw.size());
+            data = heap_.get();
+        }
+        memcpy(data, raw.data(), raw.size());
+        raw_ = std::string_view(data, raw.size());
+    }
+
+private:
+    char inline_[INLINE_SIZE];
+    std::unique_ptr<char[]> heap_;
+};
+
+class JRawNumberView : public JRawNumber {
+public:
+    JRawNumberView(std::string_view raw, std::shared_ptr<const void> owner) : owner_(std::move(owner)) {
+        raw_ = raw;
+    }
+
+private:
+    std::shared_ptr<const void> owner_;
+};
+
+std::shared_ptr<JNumber> JNumber::NewRaw(std::string_view raw) {
+    return std::make_shared<JOwnedRawNumber>(raw);
+}
+
+std::shared_ptr<JNumber> JNumber::NewRawView(std::string_view raw, std::shared_ptr<const void> owner) {
+    return std::make_shared<JRawNumberView>(raw, std::move(owner));
+}
+
+
+
+namespace {
+
+// splitmix64的终结函数，把输入的每一位扩散到全部64位.
+uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// MurmurHash64A，按小端读取8字节分组，结果与平台和进程无关.
+uint64_t hashBytes(const char *data, size_t len, uint64_t seed) {
+    const uint64_t m = 0xC6A4A7935BD1E995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+    const char *end = data + (len & ~static_cast<size_t>(7));
+    for (const char *p = data; p != end; p += 8) {
+        uint64_t k = 0;
+        for (int i = 0; i < 8; i++)
+            k |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    switch (len & 7) {
+        case 7: h ^= static_cast<uint64_t>(static_cast<unsigned char>(end[6])) << 48; [[fallthrough]];
+        case 6: h ^= static_cast<uint64_t>(static_cast<unsigned char>(end[5])) << 40; [[fallthrough]];
+        case 5: h ^= static_cast<uint64_t>(static_cast<unsigned char>(end[4])) << 32; [[fallthrough]];
+        case 4: h ^= static_cast<uint64_t>(static_cast<unsigned char>(end[3])) << 24; [[fallthrough]];
+        case 3: h ^= static_cast<uint64_t>(static_cast<unsigned char>(end[2])) << 16; [[fallthrough]];
+        case 2: h ^= static_cast<uint64_t>(static_cast<unsigned char>(end[1])) << 8; [[fallthrough]];
+        case 1: h ^= static_cast<uint64_t>(static_cast<unsigned char>(end[0]));
+            h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+}
+
+namespace {
+
+// 数字的精确值：能精确表示为int64的（范围内的整数原文或整数值的double）按int64，其余按double.
+// 每个数字只对应一种表示，按此比较的equals满足传递性
+struct ExactNumber {
+    bool integral;
+    int64_t i;
+    double d;
+};
+
+ExactNumber exactValue(const JNumber &number) {
+    int64_t i = 0;
+    if (number.hasRaw() && exactInt64(number.getRaw(), i))
+        return {true, i, 0};
+    double d = number.getDouble();
+    if (d == std::floor(d) && d >= -9223372036854775808.0 && d < 9223372036854775808.0)
+        return {true, static_cast<int64_t>(d), 0};
+    return {false, 0, d};
+}
+
+}
+
+bool JElement::equals(JElement &other) {
+    if (this == &other)
+        return true;
+    JType t = type();
+    if (t != other.type())
+        return false;
+    switch (t) {
+        case JType::JNULL:
+        case JType::JTRUE:
+        case JType::JFALSE:
+            return true;
+        case JType::JNUMBER: {
+            ExactNumber a = exactValue(*static_cast<JNumber *>(this));
+            ExactNumber b = exactValue(static_cast<JNumber &>(other));
+            return a.integral == b.integral && (a.integral ? a.i == b.i : a.d == b.d);
+        }
+        case JType::JSTRING:
+            return static_cast<JString *>(this)->getView() == static_cast<JString &>(other).getView();
+        case JType::JARRAY: {
+            auto &a = static_cast<JArray *>(this)->arrayValue_;
+            auto &b = static_cast<JArray &>(other).arrayValue_;
+            if (a.size() != b.size())
+                return false;
+            if (static_cast<JArray *>(this)->hashCached_ && static_cast<JArray &>(other).hashCached_
+                && static_cast<JArray *>(this)->hash_ != static_cast<JArray &>(other).hash_)
+                return false;
+            for (size_t i = 0; i < a.size(); i++)
+                if (!a[i]->equals(*b[i]))
+                    return false;
+            return true;
+        }
+        case JType::JOBJECT: {
+            auto &a = static_cast<JObject *>(this)->objectValue_;
+            auto &b = static_cast<JObject &>(other).objectValue_;
+            if (a.size() != b.size())
+                return false;
+            if (static_cast<JObject *>(this)->hashCached_ && static_cast<JObject &>(other).hashCached_
+                && static_cast<JObject *>(this)->hash_ != static_cast<JObject &>(other).hash_)
+                return false;
+            for (auto iter = a.begin(); iter != a.end();) {
+                auto range = b.equal_range(iter->first);
+                size_t count = a.count(iter->first);
+                if (static_cast<size_t>(std::distance(range.first, range.second)) != count)
+                    return false;
+                if (count == 1) {
+                    if (!iter->second->equals(*range.first->second))
+                        return false;
+                    ++iter;
+                    continue;
+                }
+                // 重复key：按多重集合匹配，每个value在对方中找一个尚未匹配的相等value
+                std::vector<bool> used(count, false);
+                for (size_t i = 0; i < count; i++, ++iter) {
+                    bool matched = false;
+                    size_t j = 0;
+                    for (auto candidate = range.first; candidate != range.second; ++candidate, ++j) {
+                        if (!used[j] && iter->second->equals(*candidate->second)) {
+                            used[j] = matched = true;
+                            break;
+                        }
+                    }
+                    if (!matched)
+                        return false;
+                }
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t JElement::hash(bool cache) {
+    JType t = type();
+    uint64_t seed = static_cast<uint64_t>(t) + 1;
+    switch (t) {
+        case JType::JNULL:
+        case JType::JTRUE:
+        case JType::JFALSE:
+            return mix64(seed);
+        case JType::JNUMBER: {
+            double n = static_cast<JNumber *>(this)->getDouble();
+            if (n == 0)
+                n = 0; // -0与0相等，哈希也须相同
+            uint64_t bits;
+            memcpy(&bits, &n, sizeof(bits));
+            return mix64(bits ^ mix64(seed));
+        }
+        case JType::JSTRING: {
+            std::string_view str = static_cast<JString *>(this)->getView();
+            return hashBytes(str.data(), str.size(), seed);
+        }
+        case JType::JARRAY: {
+            auto *array = static_cast<JArray *>(this);
+            if (array->hashCached_)
+                return array->hash_;
+            uint64_t h = mix64(seed ^ array->arrayValue_.size());
+            for (const auto &e : array->arrayValue_)
+                h = mix64(h ^ e->hash(cache));
+            if (cache) {
+                array->hash_ = h;
+                array->hashCached_ = true;
+            }
+            return h;
+        }
+        case JType::JOBJECT: {
+            auto *object = static_cast<JObject *>(this);
+            if (object->hashCached_)
+                return object->hash_;
+            // 各成员哈希相加，结果与遍历顺序无关；重复key也各自计入
+            uint64_t sum = 0;
+            for (const auto &pair : object->objectValue_)
+                sum += mix64(hashBytes(pair.first.str().data(), pair.first.str().size(), 0) ^ pair.second->hash(cache));
+            uint64_t h = mix64(sum ^ mix64(seed ^ object->objectValue_.size()));
+            if (cache) {
+                object->hash_ = h;
+                object->hashCached_ = true;
+            }
+            return h;
+        }
+    }
+    return 0;
+}
+
+bool JsonColumns::Column::isNull(size_t row) const {
+    if (row / 64 >= nullBitmap.size())
+        return false;
+    return (nullBitmap[row / 64] >> (row % 64)) & 1;
+}
+
+std::string_view JsonColumns::Column::getString(size_t row) const {
+    return std::string_view(blob).substr(offsets.at(row), offsets.at(row + 1) - offsets[row]);
+}
+
+const JsonColumns::Column &JsonColumns::column(const std::string &name) const {
+    for (const auto &c : columns)
+        if (c.name == name)
+            return c;
+    throw std::out_of_range("column not found.");
+}
+
+namespace {
+
+// 按RFC 6901拆分JSON Pointer并还原~1、~0，""表示根
+std::vector<std::string> parsePointer(std::string_view pointer) {
+    std::vector<std::string> tokens;
+    if (pointer.empty())
+        return tokens;
+    if (pointer[0] != '/')
+        throw std::invalid_argument("invalid JSON pointer: " + std::string(pointer));
+    for (size_t i = 1;; i++) {
+        std::string token;
+        for (; i < pointer.size() && pointer[i] != '/'; i++) {
+            if (pointer[i] != '~') {
+                token += pointer[i];
+            } else if (i + 1 < pointer.size() && (pointer[i + 1] == '0' || pointer[i + 1] == '1')) {
+                token += pointer[++i] == '0' ? '~' : '/';
+            } else {
+                throw std::invalid_argument("invalid JSON pointer: " + std::string(pointer));
+            }
+        }
+        tokens.push_back(std::move(token));
+        if (i >= pointer.size())
+            return tokens;
+    }
+}
+
+void appendToken(std::string &path, std::string_view token) {
+    path += '/';
+    for (char c : token) {
+        if (c == '~')
+            path += "~0";
+        else if (c == '/')
+            path += "~1";
+        else
+            path += c;
+    }
+}
+
+// 数组下标不允许前导0和符号；allowEnd时"-"及size表示末尾之后
+size_t parseIndex(const std::string &token, size_t size, bool allowEnd) {
+    if (allowEnd && token == "-")
+        return size;
+    size_t index = 0;
+    auto result = std::from_chars(token.data(), token.data() + token.size(), index);
+    if (token.empty() || (token[0] == '0' && token.size() > 1) || result.ec != std::errc()
+        || result.ptr != token.data() + token.size())
+        throw std::invalid_argument("invalid array index: " + token);
+    if (index > size || (index == size && !allowEnd))
+        throw std::out_of_range("array index out of range: " + token);
+    return index;
+}
+
+// 深拷贝容器；其余类型不可变，直接共享
+std::shared_ptr<JElement> clone(const std::shared_ptr<JElement> &e) {
+    if (e->isJObject()) {
+        auto ret = JObject::New();
+        for (const auto &pair : e->getAsObjectRef())
+            ret->addElement(pair.first, clone(pair.second));
+        return ret;
+    }
+    if (e->isJArray()) {
+        auto ret = JArray::New();
+        for (const auto &element : e->getAsArrayRef())
+            ret->addElement(clone(element));
+        return ret;
+    }
+    return e;
+}
+
+std::shared_ptr<JElement> member(JObject &op, std::string_view name) {
+    auto iter = op.pairs().find(name);
+    if (iter == op.pairs().end())
+        throw std::invalid_argument("patch operation is missing \"" + std::string(name) + "\"");
+    return iter->second;
+}
+
+std::string pointerMember(JObject &op, std::string_view name) {
+    auto value = member(op, name);
+    if (!value->isJString())
+        throw std::invalid_argument("\"" + std::string(name) + "\" must be a string");
+    return value->getAsString();
+}
+
+// 与JElement::hash结构相同，但子树哈希记在memo中而不是缓存在树里，diff结束后不留痕迹
+uint64_t memoHash(JElement &e, std::unordered_map<const JElement *, uint64_t> &memo) {
+    if (!e.isJObject() && !e.isJArray())
+        return e.hash();
+    uint64_t h;
+    if (e.isJArray()) {
+        auto &array = e.getAsArrayRef();
+        h = mix64(static_cast<uint64_t>(JElement::JType::JARRAY) ^ array.size());
+        for (const auto &element : array)
+            h = mix64(h ^ memoHash(*element, memo));
+    } else {
+        auto &object = e.getAsObjectRef();
+        uint64_t sum = 0;
+        for (const auto &pair : object)
+            sum += mix64(hashBytes(pair.first.str().data(), pair.first.str().size(), 0) ^ memoHash(*pair.second, memo));
+        h = mix64(sum ^ mix64(static_cast<uint64_t>(JElement::JType::JOBJECT) ^ object.size()));
+    }
+    memo[&e] = h;
+    return h;
+}
+
+bool sameTree(const std::shared_ptr<JElement> &a, const std::shared_ptr<JElement> &b,
+              std::unordered_map<const JElement *, uint64_t> &memo) {
+    if (a == b)
+        return true;
+    auto hashOf = [&memo](JElement &e) {
+        auto iter = memo.find(&e);
+        return iter == memo.end() ? e.hash() : iter->second;
+    };
+    return hashOf(*a) == hashOf(*b) && a->equals(*b);
+}
+
+}
+
+JElement &JsonPatch::child(JElement &container, const std::string &token, bool modify) {
+    if (container.isJObject()) {
+        auto &object = static_cast<JObject &>(container);
+        auto iter = object.objectValue_.find(token);
+        if (iter == object.objectValue_.end())
+            throw std::out_of_range("path not found: " + token);
+        if (modify)
+            object.hashCached_ = false;
+        return *iter->second;
+    }
+    if (container.isJArray()) {
+        auto &array = static_cast<JArray &>(container);
+        size_t index = parseIndex(token, array.arrayValue_.size(), false);
+        if (modify)
+            array.hashCached_ = false;
+        return *array.arrayValue_[index];
+    }
+    throw std::out_of_range("path not found: " + token);
+}
+
+std::shared_ptr<JElement> JsonPatch::apply(std::shared_ptr<JElement> doc, JElement &patch) {
+    if (!patch.isJArray())
+        throw std::invalid_argument("JSON Patch must be an array");
+
+    // 返回tokens最后一项所在的容器，modify时沿途使缓存的哈希失效
+    auto parent = [&doc](const std::vector<std::string> &tokens, bool modify) -> JElement & {
+        JElement *e = doc.get();
+        for (size_t i = 0; i + 1 < tokens.size(); i++)
+            e = &child(*e, tokens[i], modify);
+        return *e;
+    };
+    auto get = [&](const std::vector<std::string> &tokens) {
+        if (tokens.empty())
+            return doc;
+        JElement &container = parent(tokens, false);
+        if (container.isJObject())
+            return container.getAsObjectRef().getElement(tokens.back());
+        if (container.isJArray())
+            return container.getAsArrayRef().at(parseIndex(tokens.back(), container.getAsArrayRef().size(), false));
+        throw std::out_of_range("path not found: " + tokens.back());
+    };
+    auto add = [&](const std::vector<std::string> &tokens, std::shared_ptr<JElement> value) {
+        if (tokens.empty()) {
+            doc = std::move(value);
+            return;
+        }
+        JElement &container = parent(tokens, true);
+        if (container.isJObject())
+            container.getAsObjectRef().setElement(tokens.back(), std::move(value));
+        else if (container.isJArray())
+            container.getAsArrayRef().insertElement(
+                    parseIndex(tokens.back(), container.getAsArrayRef().size(), true), std::move(value));
+        else
+            throw std::out_of_range("path not found: " + tokens.back());
+    };
+    auto remove = [&](const std::vector<std::string> &tokens) {
+        if (tokens.empty())
+            throw std::invalid_argument("cannot remove the root");
+        JElement &container = parent(tokens, true);
+        if (container.isJObject()) {
+            auto &object = container.getAsObjectRef();
+            auto value = object.getElement(tokens.back());
+            object.removeElement(tokens.back());
+            return value;
+        }
+        if (container.isJArray()) {
+            auto &array = container.getAsArrayRef();
+            size_t index = parseIndex(tokens.back(), array.size(), false);
+            auto value = array.at(index);
+            array.removeElement(index);
+            return value;
+        }
+        throw std::out_of_range("path not found: " + tokens.back());
+    };
+
+    for (const auto &e : patch.getAsArrayRef()) {
+        if (!e->isJObject())
+            throw std::invalid_argument("patch operation must be an object");
+        auto &op = e->getAsObjectRef();
+        auto name = member(op, "op");
+        if (!name->isJString())
+            throw std::invalid_argument("\"op\" must be a string");
+        std::string_view type = name->getAsStringView();
+        std::string path = pointerMember(op, "path");
+        auto tokens = parsePointer(path);
+        if (type == "add") {
+            add(tokens, clone(member(op, "value")));
+        } else if (type == "remove") {
+            remove(tokens);
+        } else if (type == "replace") {
+            if (tokens.empty()) {
+                doc = clone(member(op, "value"));
+                continue;
+            }
+            JElement &container = parent(tokens, true);
+            if (container.isJObject()) {
+                auto &object = container.getAsObjectRef();
+                if (!object.hasKey(tokens.back()))
+                    throw std::out_of_range("path not found: " + path);
+                object.setElement(tokens.back(), clone(member(op, "value")));
+            } else if (container.isJArray()) {
+                auto &array = container.getAsArrayRef();
+                array.setElement(parseIndex(tokens.back(), array.size(), false), clone(member(op, "value")));
+            } else {
+                throw std::out_of_range("path not found: " + path);
+            }
+        } else if (type == "move") {
+            std::string from = pointerMember(op, "from");
+            if (from == path)
+                continue;
+            if (path.compare(0, from.size() + 1, from + "/") == 0)
+                throw std::invalid_argument("cannot move " + from + " into its own child " + path);
+            // 被移动的子树直接挂到新位置，不复制
+            add(tokens, remove(parsePointer(from)));
+        } else if (type == "copy") {
+            add(tokens, clone(get(parsePointer(pointerMember(op, "from")))));
+        } else if (type == "test") {
+            if (!get(tokens)->equals(*member(op, "value")))
+                throw std::runtime_error("test failed: " + path);
+        } else {
+            throw std::invalid_argument("unknown patch operation: " + std::string(type));
+        }
+    }
+    return doc;
+}
+
+std::shared_ptr<JElement> JsonPatch::mergePatch(std::shared_ptr<JElement> doc, JElement &patch) {
+    if (!patch.isJObject())
+        return clone(patch.shared_from_this());
+    if (!doc || !doc->isJObject())
+        doc = JObject::New();
+    auto &target = static_cast<JObject &>(*doc);
+    for (const auto &pair : static_cast<JObject &>(patch)) {
+        if (pair.second->isJNull()) {
+            target.removeElement(pair.first.str());
+            continue;
+        }
+        auto iter = target.objectValue_.find(pair.first);
+        std::shared_ptr<JElement> current = iter == target.objectValue_.end() ? nullptr : iter->second;
+        target.setElement(pair.first, mergePatch(std::move(current), *pair.second));
+    }
+    return doc;
+}
+
+std::shared_ptr<JArray> JsonPatch::diff(const std::shared_ptr<JElement> &from, const std::shared_ptr<JElement> &to) {
+    auto ops = JArray::New();
+    std::string path;
+    HashMemo hashes;
+    memoHash(*from, hashes);
+    memoHash(*to, hashes);
+    diff(from, to, path, *ops, hashes);
+    return ops;
+}
+
+void JsonPatch::diff(const std::shared_ptr<JElement> &from, const std::shared_ptr<JElement> &to,
+                     std::string &path, JArray &ops, HashMemo &hashes) {
+    if (sameTree(from, to, hashes))
+        return;
+    auto emit = [&ops, &path](const char *type, std::shared_ptr<JElement> value) {
+        auto op = JObject::New();
+        op->addElement("op", JString::New(type));
+        op->addElement("path", JString::New(path));
+        if (value)
+            op->addElement("value", std::move(value));
+        ops.addElement(std::move(op));
+    };
+    size_t length = path.size();
+
+    if (from->isJObject() && to->isJObject()) {
+        auto &a = from->getAsObjectRef().objectValue_;
+        auto &b = to->getAsObjectRef().objectValue_;
+        // 重复key的成员在迭代中相邻. 路径无法区分它们，生成的patch无法还原to
+        for (const auto *map : {&a, &b}) {
+            for (auto iter = map->begin(); iter != map->end(); ++iter) {
+                auto next = std::next(iter);
+                if (next != map->end() && next->first == iter->first)
+                    throw std::invalid_argument("cannot diff objects with duplicate key \"" + iter->first.str() + "\"");
+            }
+        }
+        for (auto iter = a.begin(); iter != a.end(); ++iter) {
+            if (b.contains(iter->first))
+                continue;
+            appendToken(path, iter->first.str());
+            emit("remove", nullptr);
+            path.resize(length);
+        }
+        for (auto iter = b.begin(); iter != b.end(); ++iter) {
+            appendToken(path, iter->first.str());
+            auto old = a.find(iter->first);
+            if (old == a.end())
+                emit("add", iter->second);
+            else
+                diff(old->second, iter->second, path, ops, hashes);
+            path.resize(length);
+        }
+        return;
+    }
+
+    if (from->isJArray() && to->isJArray()) {
+        auto &a = from->getAsArrayRef().arrayValue_;
+        auto &b = to->getAsArrayRef().arrayValue_;
+        // 去掉相同的首尾，只比较中间变化的部分
+        size_t prefix = 0, suffix = 0;
+        size_t shorter = std::min(a.size(), b.size());
+        while (prefix < shorter && sameTree(a[prefix], b[prefix], hashes))
+            prefix++;
+        while (suffix < shorter - prefix && sameTree(a[a.size() - 1 - suffix], b[b.size() - 1 - suffix], hashes))
+            suffix++;
+        size_t na = a.size() - prefix - suffix, nb = b.size() - prefix - suffix;
+        for (size_t i = 0; i < std::min(na, nb); i++) {
+            path += '/' + std::to_string(prefix + i);
+            diff(a[prefix + i], b[prefix + i], path, ops, hashes);
+            path.resize(length);
+        }
+        // 从后往前删除，前面的下标保持不变
+        for (size_t i = prefix + na; i-- > prefix + nb;) {
+            path += '/' + std::to_string(i);
+            emit("remove", nullptr);
+            path.resize(length);
+        }
+        for (size_t i = prefix + na; i < prefix + nb; i++) {
+            path += '/' + std::to_string(i);
+            emit("add", b[i]);
+            path.resize(length);
+        }
+        return;
+    }
+
+    emit("replace", to);
+}
@@ -7,16 +7,27 @@
 #ifndef JSONPARSER_JSONPARSER_H
 #define JSONPARSER_JSONPARSER_H
 
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 #include <unordered_map>
 #include <memory>
+#include <shared_mutex>
 #include <iostream>
+#include <functional>
+#include <coroutine>
+#include <exception>
+#include <iterator>
 
 /** 头文件只提供用户直接访问的接口 */
 
 class JsonParserImpl;
 
+struct JsonSchemaImpl;
+struct JsonDocumentCacheImpl;
+
 class ParseError : public std::exception {
 public:
     enum Error {
@@ -30,10 +41,13 @@ public:
         MISS_KEY,
         MISS_COLON,
         MISS_COMMA_OR_CURLY_BRACKET,
-        REDUNDANT_COMMA
+        REDUNDANT_COMMA,
+        NESTING_TOO_DEEP,
+        INVALID_UTF8_CHAR,
+        SCHEMA_MISMATCH
     };
 
-    ParseError(Error e, JsonParserImpl *impl);
+    ParseError(Error e, JsonParserImpl *impl, const std::string &detail = std::string());
 
     const char *what() const noexcept override {
         return msg_.data();
@@ -89,13 +103,46 @@ public:
     /* 便利函数，内部执行了向下转型操作 */
     std::string getAsString();
 
+    /* 不拷贝的版本，返回值在该JString存活期间有效 */
+    std::string_view getAsStringView();
+
     double getAsDouble();
 
+    int64_t getAsInt64();
+
     bool getAsBoolean();
 
     std::shared_ptr<JArray> getAsArray();
 
     std::shared_ptr<JObject> getAsObject();
+
+    /* 借用版本：不增加引用计数，返回的引用在调用方持有的文档存活期间有效 */
+    JArray &getAsArrayRef();
+
+    JObject &getAsObjectRef();
+
+    /* 结构相等：类型不同或容器大小不同时立即返回，object不计key顺序，number按数值比较 */
+    bool equals(JElement &other);
+
+    /*
+     * 与equals一致的稳定64位哈希（不依赖进程、地址或key顺序）.
+     * cache为true时把子树哈希缓存在JObject/JArray中供后续hash/equals复用，
+     * 容器自身的增删改会使缓存失效，但通过子元素指针做的修改不会，因此只应对不再修改的树使用.
+     */
+    uint64_t hash(bool cache = false);
+};
+
+/* 供unordered_set/map以结构相等对文档去重 */
+struct JElementHash {
+    size_t operator()(const std::shared_ptr<JElement> &e) const {
+        return static_cast<size_t>(e->hash(true));
+    }
+};
+
+struct JElementEqual {
+    bool operator()(const std::shared_ptr<JElement> &a, const std::shared_ptr<JElement> &b) const {
+        return a->equals(*b);
+    }
 };
 
 class JNull : public JElement {
@@ -131,8 +178,120 @@ public:
     std::string toJson() override;
 };
 
+/**
+ * object的key：不可变的字符串及其预先计算好的哈希.
+ * 经JsonKeyTable驻留的相同key共享同一份存储，比较时先比较指针.
+ */
+class JKey {
+public:
+    /* 空key */
+    JKey();
+
+    /* 不驻留，单独分配存储 */
+    explicit JKey(std::string_view str);
+
+    JKey(const JKey &) = default;
+
+    JKey &operator=(const JKey &) = default;
+
+    /* 被移动后的JKey成为空key而不是持有空指针，仍可正常使用 */
+    JKey(JKey &&other) noexcept : entry_(std::exchange(other.entry_, empty())) {}
+
+    JKey &operator=(JKey &&other) noexcept {
+        entry_ = std::exchange(other.entry_, empty());
+        return *this;
+    }
+
+    const std::string &str() const {
+        return entry_->str;
+    }
+
+    size_t hash() const {
+        return entry_->hash;
+    }
+
+    bool operator==(const JKey &other) const {
+        return entry_ == other.entry_ || (entry_->hash == other.entry_->hash && entry_->str == other.entry_->str);
+    }
+
+    bool operator==(std::string_view other) const {
+        return entry_->str == other;
+    }
+
+    /*
+     * 与std::hash<std::string_view>一致，因此可直接用string_view查找.
+     * 有意不声明noexcept：libstdc++据此在节点中缓存哈希值，遍历桶时不必再经entry_间接读取.
+     */
+    struct Hash {
+        using is_transparent = void;
+
+        size_t operator()(const JKey &key) const {
+            return key.hash();
+        }
+
+        size_t operator()(std::string_view str) const {
+            return std::hash<std::string_view>()(str);
+        }
+    };
+
+    struct Equal {
+        using is_transparent = void;
+
+        bool operator()(const JKey &a, const JKey &b) const {
+            return a == b;
+        }
+
+        bool operator()(const JKey &a, std::string_view b) const {
+            return a == b;
+        }
+
+        bool operator()(std::string_view a, const JKey &b) const {
+            return b == a;
+        }
+    };
+
+private:
+    friend class JsonKeyTable;
+
+    struct Entry {
+        std::string str;
+        size_t hash;
+    };
+
+    explicit JKey(std::shared_ptr<const Entry> entry) : entry_(std::move(entry)) {}
+
+    // 所有空key共享的存储
+    static const std::shared_ptr<const Entry> &empty() noexcept;
+
+    std::shared_ptr<const Entry> entry_;
+};
+
+/**
+ * 线程安全的key驻留表，可在多个JsonParser之间共享.
+ * 驻留的key在表存活期间不会释放；表满capacity后新出现的key不再驻留，以免被大量不同的key撑大.
+ */
+class JsonKeyTable {
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 4096;
+
+    explicit JsonKeyTable(size_t capacity = DEFAULT_CAPACITY);
+
+    JKey intern(std::string_view str);
+
+    size_t size() const;
+
+private:
+    mutable std::shared_mutex mutex_;
+    // key指向对应JKey自己的存储
+    std::unordered_map<std::string_view, JKey> keys_;
+    size_t capacity_;
+};
+
 class JObject : public JElement {
 public:
+    using Map = std::unordered_multimap<JKey, std::shared_ptr<JElement>, JKey::Hash, JKey::Equal>;
+    using const_iterator = Map::const_iterator;
+
     static std::shared_ptr<JObject> New() {
         return std::make_shared<JObject>();
     }
@@ -143,22 +302,55 @@ public:
 
     size_t size() const;
 
-    auto pairs() const;
+    /* 成员的只读视图，不拷贝 */
+    const Map &pairs() const;
+
+    const_iterator begin() const;
+
+    const_iterator end() const;
+
+    bool hasKey(std::string_view key) const;
+
+    /* 以驻留的key查找时不需要重新计算哈希，比较也只需比较指针 */
+    bool hasKey(const JKey &key) const;
+
+    std::shared_ptr<JElement> getElement(std::string_view key);
 
-    bool hasKey(const std::string &key) const;
+    std::shared_ptr<JElement> getElement(const JKey &key);
 
-    std::shared_ptr<JElement> getElement(const std::string &key);
+    /* 借用版本：不存在时返回nullptr而不是抛出异常，也不增加引用计数 */
+    JElement *findElement(std::string_view key) const;
 
-    auto getMultiElements(const std::string &key);
+    JElement *findElement(const JKey &key) const;
+
+    /* 同一key对应的全部成员 */
+    std::pair<const_iterator, const_iterator> getMultiElements(std::string_view key) const;
 
     void addElement(const std::string &key, std::shared_ptr<JElement> e);
 
+    void addElement(JKey key, std::shared_ptr<JElement> e);
+
+    /* 替换key对应的成员，key重复时只保留一个；不存在时插入 */
+    void setElement(std::string_view key, std::shared_ptr<JElement> e);
+
+    void setElement(JKey key, std::shared_ptr<JElement> e);
+
+    /* 删除key对应的全部成员，返回删除的个数 */
+    size_t removeElement(std::string_view key);
+
 private:
-    std::unordered_multimap<std::string, std::shared_ptr<JElement>> objectValue_;
+    friend class JElement;
+    friend class JsonPatch;
+
+    Map objectValue_;
+    uint64_t hash_ = 0;
+    bool hashCached_ = false;
 };
 
 class JArray : public JElement {
 public:
+    using const_iterator = std::vector<std::shared_ptr<JElement>>::const_iterator;
+
     static std::shared_ptr<JArray> New() {
         return std::make_shared<JArray>();
     }
@@ -171,15 +363,32 @@ public:
 
     std::shared_ptr<JElement> getElement(size_t index) const;
 
+    /* 借用版本：返回引用而不是拷贝shared_ptr，越界时抛出std::out_of_range */
+    const std::shared_ptr<JElement> &at(size_t index) const;
+
+    const std::vector<std::shared_ptr<JElement>> &elements() const;
+
+    const_iterator begin() const;
+
+    const_iterator end() const;
+
     void setElement(size_t index, std::shared_ptr<JElement> e);
 
     void addElement(std::shared_ptr<JElement> e);
 
     void removeElement(size_t index);
 
+    /* 插入到index之前，index等于size()时追加，大于size()时抛出std::out_of_range */
+    void insertElement(size_t index, std::shared_ptr<JElement> e);
+
 private:
+    friend class JElement;
+    friend class JsonPatch;
+
     /* 因多态需要，使用shared_ptr类型 */
     std::vector<std::shared_ptr<JElement>> arrayValue_;
+    uint64_t hash_ = 0;
+    bool hashCached_ = false;
 };
 
 class JString : public JElement {
@@ -192,6 +401,12 @@ public:
         return std::make_shared<JString>(std::move(str));
     }
 
+    /*
+     * 不拷贝，直接引用owner所持有的内存中的str，owner在此JString存活期间一直被持有.
+     * 返回的是单独的派生类型，普通JString不为引用付出内存.
+     */
+    static std::shared_ptr<JString> NewView(std::string_view str, std::shared_ptr<const void> owner);
+
     JType type() override;
 
     std::string toJson() override;
@@ -202,6 +417,11 @@ public:
 
     std::string getStr() const;
 
+    /* 不拷贝，返回值在此JString存活期间有效 */
+    virtual std::string_view getView() const {
+        return strValue_;
+    }
+
 private:
     std::string strValue_;
 };
@@ -212,33 +432,343 @@ public:
         return std::make_shared<JNumber>(n);
     }
 
+    /*
+     * 保存已校验的数字原文，转换推迟到getDouble/getInt64时进行，toJson原样输出.
+     * 返回的是单独的派生类型，普通JNumber不为原文付出内存. 不超过32字节的原文存放在节点内，不额外分配.
+     */
+    static std::shared_ptr<JNumber> NewRaw(std::string_view raw);
+
+    /* 同NewRaw，但不拷贝，直接引用owner所持有的内存中的raw，owner在此JNumber存活期间一直被持有 */
+    static std::shared_ptr<JNumber> NewRawView(std::string_view raw, std::shared_ptr<const void> owner);
+
     JType type() override;
 
     std::string toJson() override;
 
     explicit JNumber(double n);
 
-    double getDouble() const;
+    virtual double getDouble() const;
+
+    /* 原文的精确值是整数(包括"1.0"、"1e2"等写法)时精确转换；否则要求数值为整数，超出int64范围时抛出std::out_of_range */
+    virtual int64_t getInt64() const;
+
+    /* 是否保存了原文 */
+    virtual bool hasRaw() const;
+
+    /* 没有原文时返回空 */
+    virtual std::string_view getRaw() const;
 
 private:
     double numberValue_;
 };
 
+/**
+ * RFC 6902 JSON Patch与RFC 7386 JSON Merge Patch.
+ * 应用时沿JSON Pointer原地修改文档，耗时与patch及其路径长度成正比，与文档大小无关.
+ * patch中的容器值会被复制，字符串、数字等不可变的值直接共享.
+ */
+class JsonPatch {
+public:
+    /*
+     * 按顺序执行patch数组中的操作(add/remove/replace/move/copy/test)，返回新的根：
+     * 只有对根路径""的操作会换根，否则返回doc本身.
+     * patch格式错误时抛出std::invalid_argument，路径不存在时抛出std::out_of_range，test不满足时抛出std::runtime_error.
+     * 出错时已执行的操作不会回滚，需要原子性时请对副本应用.
+     */
+    static std::shared_ptr<JElement> apply(std::shared_ptr<JElement> doc, JElement &patch);
+
+    /* patch为object时逐个合并，值为null表示删除该key；否则patch整体替换doc */
+    static std::shared_ptr<JElement> mergePatch(std::shared_ptr<JElement> doc, JElement &patch);
+
+    /*
+     * 生成把from变为to的patch. 先对两棵树的每个子树计算一次哈希（只保存在本次调用内，不写入树中），
+     * 借此跳过相同的子树. 结果中的值与to共享，应用前不要修改to.
+     * 需要逐成员比较的object中有重复key时无法用JSON Pointer表达，抛出std::invalid_argument.
+     */
+    static std::shared_ptr<JArray> diff(const std::shared_ptr<JElement> &from, const std::shared_ptr<JElement> &to);
+
+private:
+    /* 对容器的修改经由此处，使路径上缓存的哈希失效 */
+    static JElement &child(JElement &container, const std::string &token, bool modify);
+
+    using HashMemo = std::unordered_map<const JElement *, uint64_t>;
+
+    static void diff(const std::shared_ptr<JElement> &from, const std::shared_ptr<JElement> &to,
+                     std::string &path, JArray &ops, HashMemo &hashes);
+};
+
+/**
+ * 协程生成器：每次恢复时从输入中再读取若干块，产出下一个解析完成的顶层元素.
+ * 只能单次遍历，异常（ParseError或I/O错误）在递增迭代器时抛出.
+ */
+class JsonStream {
+public:
+    struct promise_type {
+        std::shared_ptr<JElement> current;
+        std::exception_ptr exception;
+
+        JsonStream get_return_object() {
+            return JsonStream(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always yield_value(std::shared_ptr<JElement> e) noexcept {
+            current = std::move(e);
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() {
+            exception = std::current_exception();
+        }
+    };
+
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::shared_ptr<JElement>;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+
+        explicit iterator(JsonStream *stream) : stream_(stream) {}
+
+        const std::shared_ptr<JElement> &operator*() const {
+            return stream_->handle_.promise().current;
+        }
+
+        iterator &operator++() {
+            stream_->resume();
+            return *this;
+        }
+
+        void operator++(int) {
+            ++*this;
+        }
+
+        bool operator==(std::default_sentinel_t) const {
+            return !stream_ || stream_->handle_.done();
+        }
+
+    private:
+        JsonStream *stream_ = nullptr;
+    };
+
+    JsonStream(JsonStream &&other) noexcept;
+
+    JsonStream &operator=(JsonStream &&other) noexcept;
+
+    JsonStream(const JsonStream &) = delete;
+
+    JsonStream &operator=(const JsonStream &) = delete;
+
+    ~JsonStream();
+
+    iterator begin();
+
+    std::default_sentinel_t end() {
+        return {};
+    }
+
+private:
+    explicit JsonStream(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    void resume();
+
+    std::coroutine_handle<promise_type> handle_;
+    bool started_ = false;
+};
+
+/**
+ * 对象数组的列式解析结果：每个被选中的key对应一列连续存储的值.
+ * 第i行缺少该key或值为null时，nullBitmap的第i位为1，对应位置存放0或空串.
+ */
+struct JsonColumns {
+    enum class Type {
+        DOUBLE, INT64, BOOLEAN, STRING
+    };
+
+    struct Spec {
+        std::string name;
+        Type type;
+    };
+
+    struct Column {
+        std::string name;
+        Type type;
+        std::vector<double> doubles;   // DOUBLE
+        std::vector<int64_t> ints;     // INT64
+        std::vector<uint8_t> booleans; // BOOLEAN
+        std::vector<size_t> offsets;   // STRING：第i行为blob[offsets[i], offsets[i + 1])
+        std::string blob;              // STRING：所有行的字符串首尾相接
+        std::vector<uint64_t> nullBitmap;
+
+        bool isNull(size_t row) const;
+
+        std::string_view getString(size_t row) const;
+    };
+
+    size_t rows = 0;
+    std::vector<Column> columns;
+
+    /* 按名字查找列，不存在时抛出std::out_of_range */
+    const Column &column(const std::string &name) const;
+};
+
+/**
+ * 编译后的JSON Schema，在解析过程中检查而不是解析后再遍历DOM.
+ * 支持的子集：type、required、properties、items、enum(标量)、minimum、maximum、maxLength，
+ * 其余关键字被忽略. 编译结果不可变，可在多个JsonParser/线程间共享.
+ */
+class JsonSchema {
+public:
+    /* schema本身不合法时抛出std::invalid_argument */
+    static JsonSchema compile(const std::shared_ptr<JElement> &schema);
+
+    static JsonSchema compile(const std::string &schema);
+
+private:
+    friend class JsonParser;
+
+    JsonSchema() = default;
+
+    std::shared_ptr<const JsonSchemaImpl> impl_;
+};
 
 class JsonParser {
 public:
+    /* 默认允许的最大容器嵌套层数，超过时抛出NESTING_TOO_DEEP */
+    static constexpr size_t DEFAULT_MAX_DEPTH = 512;
+
+    /* stream每次读取的字节数 */
+    static constexpr size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
     JsonParser();
 
     std::shared_ptr<JElement> parse(const char *s, size_t len);
 
     std::shared_ptr<JElement> parse(const std::string &str);
 
+    /*
+     * 零拷贝模式：长度超过std::string内联容量且不含转义的字符串直接引用input，
+     * 含转义的字符串解码后由各自的JString持有. 返回的文档持有input，无需调用者维持其生命周期.
+     */
+    std::shared_ptr<JElement> parseZeroCopy(std::shared_ptr<const std::string> input);
+
+    /* 只校验语法和UTF-8编码而不构建DOM，非法时抛出ParseError */
+    void validate(std::string_view str);
+
+    bool isValid(std::string_view str);
+
+    /* 解析的同时按schema检查，遇到第一处不符合即抛出SCHEMA_MISMATCH */
+    std::shared_ptr<JElement> parse(const std::string &str, const JsonSchema &schema);
+
+    void validate(std::string_view str, const JsonSchema &schema);
+
+    /*
+     * 不构建DOM，直接把str重排版后写入out：indent为0时压缩为一行，否则每层缩进indent个空格.
+     * key顺序、数字与字符串原文均保持不变. str非法时抛出ParseError，此时out中可能已写入部分内容.
+     */
+    void format(std::string_view str, std::ostream &out, int indent = 0);
+
+    std::string minify(std::string_view str);
+
+    std::string prettify(std::string_view str, int indent = 4);
+
+    /*
+     * 把由对象组成的数组直接解析为specs指定的列，不构建DOM.
+     * 未选中的key被跳过；值与列类型不符（INT64列遇到小数、选中的key对应容器等）时抛出SCHEMA_MISMATCH.
+     */
+    JsonColumns parseColumns(std::string_view str, const std::vector<JsonColumns::Spec> &specs);
+
+    /*
+     * 以chunkSize为单位读取输入，逐个产出顶层数组的元素；输入不是数组时逐个产出连续的多个文档(如NDJSON).
+     * 内存占用约为最大单个元素加一个chunk. 返回的JsonStream不依赖本JsonParser，但in/fd须在遍历期间有效.
+     */
+    JsonStream stream(std::istream &in, size_t chunkSize = DEFAULT_CHUNK_SIZE);
+
+    JsonStream stream(int fd, size_t chunkSize = DEFAULT_CHUNK_SIZE);
+
+    /*
+     * 同stream，但输入是gzip（或zlib）压缩的：后台线程解压到ringSize个chunk组成的环中，
+     * 解压与解析在两个线程上并行，内存占用约为(ringSize + 2)个chunk加最大单个元素.
+     * 定义在JsonGzip.cpp中，使用时须另外编译该文件并链接zlib与pthread.
+     */
+    JsonStream streamGzip(std::istream &in, size_t chunkSize = DEFAULT_CHUNK_SIZE, size_t ringSize = 4);
+
+    JsonStream streamGzip(const std::string &path, size_t chunkSize = DEFAULT_CHUNK_SIZE, size_t ringSize = 4);
+
+    void setMaxDepth(size_t depth);
+
+    size_t maxDepth() const;
+
+    /* 解析时用于驻留object key的表，默认每个JsonParser独占一张 */
+    void setKeyTable(std::shared_ptr<JsonKeyTable> table);
+
+    std::shared_ptr<JsonKeyTable> keyTable() const;
+
+    /* 开启后parse得到的JNumber只保存原文，见JNumber::NewRaw. 默认关闭 */
+    void setLazyNumbers(bool lazy);
+
     ~JsonParser();
 
 private:
+    // 供定义在其他源文件中的流式解析(如JsonGzip.cpp)复用，read返回0表示输入结束
+    JsonStream streamFrom(std::function<size_t(char *, size_t)> read, size_t chunkSize);
+
     std::unique_ptr<JsonParserImpl> impl_;
 };
 
+/**
+ * 按输入内容缓存解析结果的LRU缓存，用于反复收到字节完全相同的文档的场景.
+ * 以输入字节的哈希查找，命中后再与保存的输入副本逐字节比较，因此哈希冲突不会返回错误的文档.
+ * 容量按遍历文档树估算的内存（含输入副本）计算，超出时淘汰最久未使用的文档.
+ * 线程安全；命中时所有调用者共享同一棵树，调用者不应修改它.
+ * 返回的树已缓存子树哈希，可以在多个线程中并发读取、hash(true)及放入unordered_set(JElementHash).
+ */
+class JsonDocumentCache {
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 64 * 1024 * 1024;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0; // 当前缓存的文档估算占用的内存
+    };
+
+    /* 单个文档估算超过capacity时照常返回，但不放入缓存 */
+    explicit JsonDocumentCache(size_t capacity = DEFAULT_CAPACITY);
+
+    /* 未命中时在锁外解析，str非法时抛出ParseError且不影响缓存 */
+    std::shared_ptr<JElement> parse(std::string_view str);
+
+    Stats stats() const;
+
+    size_t capacity() const;
+
+    void clear();
+
+    /* 以下设置只影响之后未命中时的解析，已缓存的文档不变 */
+    void setMaxDepth(size_t depth);
+
+    void setLazyNumbers(bool lazy);
+
+    ~JsonDocumentCache();
+
+private:
+    std::unique_ptr<JsonDocumentCacheImpl> impl_;
+};
+
 
 #endif //JSONPARSER_JSONPARSER_H
 
@@ -2,77 +2,161 @@
 // Created by Hello Peter on 2021/8/15.
 //
 #include <cmath>
-#include <cassert>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <charconv>
+#include <system_error>
+#include <utility>
+#include <unistd.h>
+#include <list>
+#include <mutex>
 #include "JsonParser.h"
 
-std::shared_ptr<JElement> JsonParser::parse(const char *s, size_t len) {
-    return parse(std::string(s, len));
-}
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-class JsonParserImpl {
-    void skipWhite() {
-        while (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')
-            ++p_;
+// 允许unordered_map<std::string, ...>直接用string_view查找，避免构造临时string.
+struct StringHash {
+    using is_transparent = void;
+
+    size_t operator()(std::string_view sv) const {
+        return std::hash<std::string_view>()(sv);
     }
+};
 
-    std::shared_ptr<JTrue> parseJTrue() {
-        if (*p_ != 't' || *(p_ + 1) != 'r' || *(p_ + 2) != 'u' || *(p_ + 3) != 'e')
-            throw ParseError(ParseError::INVALID_VALUE, this);
-        p_ += 4;
-        return JTrue::New();
+/*
+ * 编译后的schema：每个子schema对应nodes中的一项，彼此通过下标引用.
+ * nodes[ANY]不做任何约束，nodes[ROOT]是根schema.
+ */
+struct JsonSchemaImpl {
+    enum Type : unsigned {
+        NUL = 1, BOOLEAN = 2, OBJECT = 4, ARRAY = 8, STRING = 16, NUMBER = 32, INTEGER = 64,
+        ALL = NUL | BOOLEAN | OBJECT | ARRAY | STRING | NUMBER | INTEGER
+    };
+
+    static constexpr size_t ANY = 0;
+    static constexpr size_t ROOT = 1;
+    static constexpr size_t NO_REQUIRED = static_cast<size_t>(-1);
+
+    // object中出现的key对应的子schema，以及它在required中的序号.
+    struct Member {
+        size_t node = ANY;
+        size_t requiredIndex = NO_REQUIRED;
+    };
+
+    // enum中的一个标量值.
+    struct EnumValue {
+        unsigned type;
+        double number;
+        std::string str;
+    };
+
+    struct Node {
+        unsigned types = ALL;
+        std::unordered_map<std::string, Member, StringHash, std::equal_to<>> members;
+        std::vector<std::string> required;
+        size_t items = ANY;
+        bool hasEnum = false;
+        std::vector<EnumValue> enumValues;
+        double minimum = -HUGE_VAL;
+        double maximum = HUGE_VAL;
+        size_t maxLength = static_cast<size_t>(-1);
+    };
+
+    std::vector<Node> nodes;
+
+    size_t compile(const std::shared_ptr<JElement> &schema);
+};
+
+class JsonParserImpl {
+    /*
+     * 输入不要求以'\0'结尾，所有读取都以end_为界.
+     * peek()在越界时返回'\0'，'\0'本身不是任何合法token的开头，因此可直接参与switch.
+     */
+    char peek() const {
+        return p_ != end_ ? *p_ : '\0';
     }
 
-    std::shared_ptr<JFalse> parseJFalse() {
-        if (*p_ != 'f' || *(p_ + 1) != 'a' || *(p_ + 2) != 'l' || *(p_ + 3) != 's' || *(p_ + 4) != 'e')
-            throw ParseError(ParseError::INVALID_VALUE, this);
-        p_ += 5;
-        return JFalse::New();
+    void skipWhite() {
+        while (p_ != end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r'))
+            ++p_;
     }
 
-    std::shared_ptr<JNull> parseJNull() {
-        if (*p_ != 'n' || *(p_ + 1) != 'u' || *(p_ + 2) != 'l' || *(p_ + 3) != 'l')
+    void expectLiteral(const char *literal, size_t len) {
+        if (static_cast<size_t>(end_ - p_) < len || memcmp(p_, literal, len) != 0)
             throw ParseError(ParseError::INVALID_VALUE, this);
-        p_ += 4;
-        return JNull::New();
+        p_ += len;
     }
 
     inline bool ISDIGIT1TO9(char ch) { return '1' <= ch && ch <= '9'; }
 
     inline bool ISDIGIT(char ch) { return '0' <= ch && ch <= '9'; }
 
-    std::shared_ptr<JNumber> parseJNumber() {
+    // 校验p_处的数字语法，返回数字之后的位置，不移动p_也不进行转换.
+    const char *scanNumber() {
         const char *p = p_;
-        if (*p == '-') p++;
-        if (*p == '0') p++;
+        auto at = [this](const char *q) { return q != end_ ? *q : '\0'; };
+        if (at(p) == '-') p++;
+        if (at(p) == '0') p++;
         else {
-            if (!ISDIGIT1TO9(*p))
+            if (!ISDIGIT1TO9(at(p)))
                 throw ParseError(ParseError::INVALID_VALUE, this);
-            for (p++; ISDIGIT(*p); p++);
+            for (p++; ISDIGIT(at(p)); p++);
         }
-        if (*p == '.') {
+        if (at(p) == '.') {
             p++;
-            if (!ISDIGIT(*p))
+            if (!ISDIGIT(at(p)))
                 throw ParseError(ParseError::INVALID_VALUE, this);
-            for (p++; ISDIGIT(*p); p++);
+            for (p++; ISDIGIT(at(p)); p++);
         }
-        if (*p == 'e' || *p == 'E') {
+        if (at(p) == 'e' || at(p) == 'E') {
             p++;
-            if (*p == '+' || *p == '-') p++;
-            if (!ISDIGIT(*p))
+            if (at(p) == '+' || at(p) == '-') p++;
+            if (!ISDIGIT(at(p)))
                 throw ParseError(ParseError::INVALID_VALUE, this);
-            for (p++; ISDIGIT(*p); p++);
+            for (p++; ISDIGIT(at(p)); p++);
+        }
+        return p;
+    }
+
+    // [begin, end)是scanNumber校验过的数字，p_应指向begin以便报错.
+    double toDouble(const char *begin, const char *end) {
+        double n = 0;
+        auto result = std::from_chars(begin, end, n);
+        if (result.ec == std::errc::result_out_of_range) {
+            // from_chars对上溢和下溢都只报告out_of_range，交给strtod区分：下溢得到0，上溢得到HUGE_VAL
+            std::string copy(begin, end);
+            errno = 0;
+            n = strtod(copy.c_str(), nullptr);
+            if (errno == ERANGE && (n == HUGE_VAL || n == -HUGE_VAL))
+                throw ParseError(ParseError::NUMBER_TOO_BIG, this);
         }
-        errno = 0;
-        auto n = strtod(p_, nullptr);
-        if (errno == ERANGE && (n == HUGE_VAL || n == -HUGE_VAL))
-            throw ParseError(ParseError::NUMBER_TOO_BIG, this);
-        p_ = p;
-        return JNumber::New(n);
+        return n;
+    }
+
+    /*
+     * 不转换数字而只检查是否上溢：没有指数部分时，整数部分不足309位就不可能超出double范围.
+     * 绝大多数数字（ID、时间戳等）在这里就能确定，其余的再完整转换一次.
+     */
+    void checkRange(const char *begin, const char *end) {
+        const char *p = begin;
+        if (*p == '-')
+            ++p;
+        const char *integerEnd = p;
+        while (integerEnd != end && ISDIGIT(*integerEnd))
+            ++integerEnd;
+        if (integerEnd - p < 309 && std::find_if(integerEnd, end, [](char ch) { return ch == 'e' || ch == 'E'; }) == end)
+            return;
+        toDouble(begin, end);
     }
 
     const char *lept_parse_hex4(const char *p, unsigned *u) {
         int i;
         *u = 0;
+        if (end_ - p < 4)
+            return nullptr;
         for (i = 0; i < 4; i++) {
             char ch = *p++;
             *u <<= 4;
@@ -84,240 +168,1067 @@ class JsonParserImpl {
         return p;
     }
 
-    void lept_encode_utf8(unsigned u) {
+    static void lept_encode_utf8(std::string &out, unsigned u) {
         if (u <= 0x7F)
-            buffer_.push_back(u & 0xFF);
+            out.push_back(static_cast<char>(u & 0xFF));
         else if (u <= 0x7FF) {
-            buffer_.push_back(0xC0 | ((u >> 6) & 0xFF));
-            buffer_.push_back(0x80 | (u & 0x3F));
+            out.push_back(static_cast<char>(0xC0 | ((u >> 6) & 0xFF)));
+            out.push_back(static_cast<char>(0x80 | (u & 0x3F)));
         } else if (u <= 0xFFFF) {
-            buffer_.push_back(0xE0 | ((u >> 12) & 0xFF));
-            buffer_.push_back(0x80 | ((u >> 6) & 0x3F));
-            buffer_.push_back(0x80 | (u & 0x3F));
+            out.push_back(static_cast<char>(0xE0 | ((u >> 12) & 0xFF)));
+            out.push_back(static_cast<char>(0x80 | ((u >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (u & 0x3F)));
         } else {
-            buffer_.push_back(0xF0 | ((u >> 18) & 0xFF));
-            buffer_.push_back(0x80 | ((u >> 12) & 0x3F));
-            buffer_.push_back(0x80 | ((u >> 6) & 0x3F));
-            buffer_.push_back(0x80 | (u & 0x3F));
+            out.push_back(static_cast<char>(0xF0 | ((u >> 18) & 0xFF)));
+            out.push_back(static_cast<char>(0x80 | ((u >> 12) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | ((u >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (u & 0x3F)));
         }
     }
 
-    std::shared_ptr<JString> parseJString() {
-        size_t old_buffer_size = buffer_.size();
-        const char *p = p_;
-        ++p;
+    // 校验p处以非ASCII字节开头的UTF-8序列(RFC 3629，拒绝过长编码和代理区)，返回序列之后的位置，非法时返回nullptr.
+    const char *validateUtf8(const char *p) const {
+        auto c = static_cast<unsigned char>(p[0]);
+        ptrdiff_t n;
+        unsigned char lo = 0x80, hi = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            n = 2;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            n = 3;
+            if (c == 0xE0) lo = 0xA0;
+            else if (c == 0xED) hi = 0x9F;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            n = 4;
+            if (c == 0xF0) lo = 0x90;
+            else if (c == 0xF4) hi = 0x8F;
+        } else {
+            return nullptr;
+        }
+        if (end_ - p < n)
+            return nullptr;
+        auto c1 = static_cast<unsigned char>(p[1]);
+        if (c1 < lo || c1 > hi)
+            return nullptr;
+        for (ptrdiff_t i = 2; i < n; i++)
+            if ((static_cast<unsigned char>(p[i]) & 0xC0) != 0x80)
+                return nullptr;
+        return p + n;
+    }
+
+    // 跳过p起不需要逐字节处理的字符，返回第一个 '"'、'\\'、控制字符或非ASCII字节的位置（或end_）.
+    const char *skipPlainChars(const char *p) const {
+#ifdef __SSE2__
+        // 有符号比较下0x80-0xFF为负数，因此 v < 0x20 同时覆盖控制字符和非ASCII字节
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i space = _mm_set1_epi8(0x20);
+        while (end_ - p >= 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                           _mm_cmplt_epi8(v, space));
+            int mask = _mm_movemask_epi8(special);
+            if (mask)
+                return p + __builtin_ctz(mask);
+            p += 16;
+        }
+#endif
+        while (p != end_) {
+            auto ch = static_cast<unsigned char>(*p);
+            if (ch == '"' || ch == '\\' || ch < 0x20 || ch >= 0x80)
+                break;
+            ++p;
+        }
+        return p;
+    }
+
+    // 字符串在输入中的原文（不含两侧引号），escaped表示其中含有转义序列.
+    struct StringSpan {
+        const char *begin;
+        const char *end;
+        bool escaped;
+    };
+
+    /*
+     * 校验p_处的字符串（转义序列、控制字符与UTF-8编码），不移动p_也不进行拷贝.
+     * 纯ASCII片段由skipPlainChars按16字节一组跳过，非ASCII字节逐个序列校验.
+     */
+    StringSpan scanString() {
+        StringSpan span{p_ + 1, nullptr, false};
+        const char *p = span.begin;
         unsigned u, u2;
         for (;;) {
-            char ch = *p++;
-            switch (ch) {
-                case '\"':
-                    p_ = p;
-                    break;
-                case '\\':
-                    switch (*p++) {
-                        case '\"':
-                            buffer_.push_back('\"');
-                            break;
-                        case '\\':
-                            buffer_.push_back('\\');
-                            break;
-                        case '/':
-                            buffer_.push_back('/');
-                            break;
-                        case 'b':
-                            buffer_.push_back('\b');
-                            break;
-                        case 'f':
-                            buffer_.push_back('\f');
-                            break;
-                        case 'n':
-                            buffer_.push_back('\n');
-                            break;
-                        case 'r':
-                            buffer_.push_back('\r');
-                            break;
-                        case 't':
-                            buffer_.push_back('\t');
-                            break;
-                        case 'u':
-                            if (!(p = lept_parse_hex4(p, &u)))
-                                throw ParseError(ParseError::INVALID_UNICODE_CHAR, this);
-                            if (u >= 0xD800 && u <= 0xDBFF) { /* surrogate pair */
-                                if (*p++ != '\\')
-                                    throw ParseError(ParseError::INVALID_UNICODE_CHAR, this);
-                                if (*p++ != 'u')
-                                    throw ParseError(ParseError::INVALID_UNICODE_CHAR, this);
-                                if (!(p = lept_parse_hex4(p, &u2)))
-                                    throw ParseError(ParseError::INVALID_UNICODE_CHAR, this);
-                                if (u2 < 0xDC00 || u2 > 0xDFFF)
-                                    throw ParseError(ParseError::INVALID_UNICODE_CHAR, this);
-                                u = (((u - 0xD800) << 10) | (u2 - 0xDC00)) + 0x10000;
-                            }
-                            lept_encode_utf8(u);
-                            break;
-                        default:
-                            throw ParseError(ParseError::INVALID_STRING_CHAR, this);
-                    }
-                    break;
-                case '\0':
+            p = skipPlainChars(p);
+            if (p == end_)
+                throw ParseError(ParseError::MISS_STRING_END_ESCAPE, this);
+            auto ch = static_cast<unsigned char>(*p);
+            if (ch == '\"') {
+                span.end = p;
+                return span;
+            } else if (ch == '\\') {
+                span.escaped = true;
+                if (++p == end_)
                     throw ParseError(ParseError::MISS_STRING_END_ESCAPE, this);
-                default:
-                    if ((unsigned char) ch < 0x20)
+                switch (*p++) {
+                    case '\"':
+                    case '\\':
+                    case '/':
+                    case 'b':
+                    case 'f':
+                    case 'n':
+                    case 'r':
+                    case 't':
+                        break;
+                    case 'u':
+                        if (!(p = lept_parse_hex4(p, &u)))
+                            throw ParseError(ParseError::INVALID_UNICODE_CHAR, this);
+                        if (u >= 0xD800 && u <= 0xDBFF) { /* surrogate pair */
+                            if (end_ - p < 2 || *p++ != '\\' || *p++ != 'u')
+                                throw ParseError(ParseError::INVALID_UNICODE_CHAR, this);
+                            if (!(p = lept_parse_hex4(p, &u2)))
+                                throw ParseError(ParseError::INVALID_UNICODE_CHAR, this);
+                            if (u2 < 0xDC00 || u2 > 0xDFFF)
+                                throw ParseError(ParseError::INVALID_UNICODE_CHAR, this);
+                        }
+                        break;
+                    default:
                         throw ParseError(ParseError::INVALID_STRING_CHAR, this);
-                    buffer_.push_back(ch);
+                }
+            } else if (ch < 0x20) {
+                throw ParseError(ParseError::INVALID_STRING_CHAR, this);
+            } else {
+                if (!(p = validateUtf8(p)))
+                    throw ParseError(ParseError::INVALID_UTF8_CHAR, this);
             }
-            if (ch == '\"')
+        }
+    }
+
+    // 将scanString校验过的字符串原文解码到out. 不含转义的字符串只需一次拷贝.
+    void decodeString(const StringSpan &span, std::string &out) {
+        if (!span.escaped) {
+            out.assign(span.begin, span.end);
+            return;
+        }
+        out.clear();
+        out.reserve(span.end - span.begin);
+        const char *p = span.begin;
+        unsigned u, u2;
+        while (p != span.end) {
+            const char *plain = p;
+            while (p != span.end && *p != '\\')
+                ++p;
+            out.append(plain, p);
+            if (p == span.end)
                 break;
+            switch (*++p) {
+                case 'b':
+                    out.push_back('\b');
+                    break;
+                case 'f':
+                    out.push_back('\f');
+                    break;
+                case 'n':
+                    out.push_back('\n');
+                    break;
+                case 'r':
+                    out.push_back('\r');
+                    break;
+                case 't':
+                    out.push_back('\t');
+                    break;
+                case 'u':
+                    p = lept_parse_hex4(p + 1, &u) - 1;
+                    if (u >= 0xD800 && u <= 0xDBFF) {
+                        p = lept_parse_hex4(p + 3, &u2) - 1;
+                        u = (((u - 0xD800) << 10) | (u2 - 0xDC00)) + 0x10000;
+                    }
+                    lept_encode_utf8(out, u);
+                    break;
+                default: // '"' '\\' '/'
+                    out.push_back(*p);
+                    break;
+            }
+            ++p;
         }
+    }
+
+    /*
+     * 语法驱动循环：按文档顺序向Handler报告事件，由Handler决定构建DOM还是仅做校验.
+     * Handler需提供以下成员：
+     *   null() / boolean(bool)
+     *   number(const char *begin, const char *end)   已校验的数字原文
+     *   string(const StringSpan &) / key(const StringSpan &)
+     *   startObject() / endObject() / startArray() / endArray()
+     * 调用number/string/key/end*时p_仍指向该token，Handler可借此抛出定位准确的ParseError.
+     *
+     * 解析是非递归的：容器的嵌套关系保存在stack_中而不是C++调用栈上，
+     * 因此恶意构造的深层嵌套输入只会触发NESTING_TOO_DEEP，而不会栈溢出.
+     * 调用前后均不进行skipWhite操作.
+     */
+    template<class Handler>
+    void parseValue(Handler &handler) {
+        stack_.clear();
+        for (;;) {
+            switch (peek()) {
+                case 't':
+                    expectLiteral("true", 4);
+                    handler.boolean(true);
+                    break;
+                case 'f':
+                    expectLiteral("false", 5);
+                    handler.boolean(false);
+                    break;
+                case 'n':
+                    expectLiteral("null", 4);
+                    handler.null();
+                    break;
+                case '"': {
+                    StringSpan span = scanString();
+                    handler.string(span);
+                    p_ = span.end + 1;
+                    break;
+                }
+                case '{':
+                    if (stack_.size() >= settings_.maxDepth)
+                        throw ParseError(ParseError::NESTING_TOO_DEEP, this);
+                    handler.startObject();
+                    ++p_;
+                    skipWhite();
+                    if (peek() == '}') {
+                        handler.endObject();
+                        ++p_;
+                        break;
+                    }
+                    stack_.push_back('{');
+                    parseKey(handler);
+                    continue;
+                case '[':
+                    if (stack_.size() >= settings_.maxDepth)
+                        throw ParseError(ParseError::NESTING_TOO_DEEP, this);
+                    handler.startArray();
+                    ++p_;
+                    skipWhite();
+                    if (peek() == ']') {
+                        handler.endArray();
+                        ++p_;
+                        break;
+                    }
+                    stack_.push_back('[');
+                    continue;
+                default: {
+                    const char *end = scanNumber();
+                    handler.number(p_, end);
+                    p_ = end;
+                    break;
+                }
+            }
 
-        auto ret = JString::New(std::string(buffer_.data() + old_buffer_size, buffer_.size() - old_buffer_size));
-        buffer_.erase(buffer_.begin() + old_buffer_size, buffer_.end());
-        assert(buffer_.size() == old_buffer_size);
-        return ret;
+            // 一个值已完成：处理随后的逗号或右括号（可能连续闭合多层）.
+            for (;;) {
+                if (stack_.empty())
+                    return;
+                skipWhite();
+                char ch = peek();
+                if (ch == ',') {
+                    ++p_;
+                    skipWhite();
+                    if (p_ == end_)
+                        throw ParseError(ParseError::REDUNDANT_COMMA, this);
+                    if (stack_.back() == '{')
+                        parseKey(handler);
+                    break;
+                }
+                if (stack_.back() == '{') {
+                    if (ch != '}')
+                        throw ParseError(ParseError::MISS_COMMA_OR_CURLY_BRACKET, this);
+                    handler.endObject();
+                } else {
+                    if (ch != ']')
+                        throw ParseError(ParseError::MISS_COMMA_OR_SQUARE_BRACKET, this);
+                    handler.endArray();
+                }
+                ++p_;
+                stack_.pop_back();
+            }
+        }
     }
 
-    std::shared_ptr<JObject> parseJObject() {
-        auto ret = JObject::New();
+    // 解析 "key" : ，完成后p_指向value的第一个非空白字符.
+    template<class Handler>
+    void parseKey(Handler &handler) {
+        if (peek() != '"')
+            throw ParseError(ParseError::MISS_KEY, this);
+        StringSpan span = scanString();
+        handler.key(span);
+        p_ = span.end + 1;
+        skipWhite();
+        if (peek() != ':')
+            throw ParseError(ParseError::MISS_COLON, this);
         ++p_;
         skipWhite();
-        if (*p_ == '}') {
-            ++p_;
-            return ret;
+    }
+
+    // 解析一个完整文档：值前后只允许空白.
+    template<class Handler>
+    void parseDocument(std::string_view str, Handler &handler) {
+        str_ = str;
+        p_ = str_.data();
+        end_ = p_ + str_.size();
+        skipWhite();
+        parseValue(handler);
+        skipWhite();
+        if (p_ != end_)
+            throw ParseError(ParseError::REDUNDANT_CHARS, this);
+    }
+
+    // 显式栈中的一帧，对应一个尚未闭合的JObject或JArray.
+    struct Frame {
+        std::shared_ptr<JObject> object;
+        std::shared_ptr<JArray> array;
+        JKey key; // object中等待value的key
+    };
+
+    // 将事件组装为JElement树的Handler.
+    class DomBuilder {
+    public:
+        explicit DomBuilder(JsonParserImpl &impl, std::shared_ptr<const std::string> input = nullptr)
+                : impl_(impl), input_(std::move(input)) {}
+
+        // 出错时释放栈中残留的半成品容器，保留frames_本身的容量.
+        ~DomBuilder() {
+            for (; depth_ > 0; --depth_) {
+                Frame &frame = impl_.frames_[depth_ - 1];
+                frame.object.reset();
+                frame.array.reset();
+            }
         }
-        for (;;) {
-            if (*p_ != '"')
-                throw ParseError(ParseError::MISS_KEY, this);
-            auto key = parseJString()->getAsString();
-            skipWhite();
-            if (*p_ != ':')
-                throw ParseError(ParseError::MISS_COLON, this);
-            ++p_;
-            skipWhite();
 
-            auto sub_element = parseSingle();
+        void null() {
+            add(JNull::New());
+        }
 
-            ret->addElement(key, sub_element);
-            skipWhite();
+        void boolean(bool b) {
+            if (b)
+                add(JTrue::New());
+            else
+                add(JFalse::New());
+        }
 
-            if (*p_ == ',') {
-                ++p_;
-                skipWhite();
-                if (*p_ == '\0')
-                    throw ParseError(ParseError::REDUNDANT_COMMA, this);
-            } else if (*p_ == '}') {
-                ++p_;
-                break;
+        void number(const char *begin, const char *end) {
+            if (impl_.settings_.lazyNumbers) {
+                impl_.checkRange(begin, end);
+                std::string_view raw(begin, end - begin);
+                add(input_ ? JNumber::NewRawView(raw, input_) : JNumber::NewRaw(raw));
             } else {
-                throw ParseError(ParseError::MISS_COMMA_OR_CURLY_BRACKET, this);
+                add(JNumber::New(impl_.toDouble(begin, end)));
             }
         }
-        return ret;
-    }
 
-    std::shared_ptr<JArray> parseJArray() {
-        auto ret = JArray::New();
-        ++p_;
-        skipWhite();
-        if (*p_ == ']') {
-            ++p_;
-            return ret;
+        void string(const StringSpan &span) {
+            // 能放进std::string内联缓冲区的短字符串拷贝反而比增加input_的引用计数更快
+            static const size_t inlineCapacity = std::string().capacity();
+            if (input_ && !span.escaped && static_cast<size_t>(span.end - span.begin) > inlineCapacity) {
+                add(JString::NewView(std::string_view(span.begin, span.end - span.begin), input_));
+                return;
+            }
+            std::string str;
+            impl_.decodeString(span, str);
+            add(JString::New(std::move(str)));
         }
-        for (;;) {
-            auto sub_element = parseSingle();
-            ret->addElement(sub_element);
-            skipWhite();
-            if (*p_ == ',') {
-                ++p_;
-                skipWhite();
-                if (*p_ == '\0')
-                    throw ParseError(ParseError::REDUNDANT_COMMA, this);
-            } else if (*p_ == ']') {
-                ++p_;
-                break;
+
+        void key(const StringSpan &span) {
+            std::string_view name(span.begin, span.end - span.begin);
+            if (span.escaped) {
+                impl_.decodeString(span, scratch_);
+                name = scratch_;
+            }
+            impl_.frames_[depth_ - 1].key = impl_.intern(name);
+        }
+
+        void startObject() {
+            push().object = JObject::New();
+        }
+
+        void endObject() {
+            add(pop(impl_.frames_[depth_ - 1].object));
+        }
+
+        void startArray() {
+            push().array = JArray::New();
+        }
+
+        void endArray() {
+            add(pop(impl_.frames_[depth_ - 1].array));
+        }
+
+        std::shared_ptr<JElement> result() {
+            return std::move(root_);
+        }
+
+    private:
+        Frame &push() {
+            auto &frames = impl_.frames_;
+            if (depth_ == frames.size())
+                frames.emplace_back();
+            return frames[depth_++];
+        }
+
+        template<class T>
+        std::shared_ptr<JElement> pop(std::shared_ptr<T> &container) {
+            --depth_;
+            return std::move(container);
+        }
+
+        void add(std::shared_ptr<JElement> e) {
+            if (depth_ == 0) {
+                root_ = std::move(e);
+                return;
+            }
+            Frame &frame = impl_.frames_[depth_ - 1];
+            if (frame.object)
+                frame.object->addElement(std::move(frame.key), std::move(e));
+            else
+                frame.array->addElement(std::move(e));
+        }
+
+        JsonParserImpl &impl_;
+        std::shared_ptr<const std::string> input_; // 零拷贝模式下被JString和惰性JNumber引用的输入
+        size_t depth_ = 0;
+        std::shared_ptr<JElement> root_;
+        std::string scratch_; // 含转义的key解码后再驻留
+    };
+
+    // 只做校验的Handler：不分配内存、不转换数字、不解码字符串.
+    struct Validator {
+        void null() {}
+
+        void boolean(bool) {}
+
+        void number(const char *, const char *) {}
+
+        void string(const StringSpan &) {}
+
+        void key(const StringSpan &) {}
+
+        void startObject() {}
+
+        void endObject() {}
+
+        void startArray() {}
+
+        void endArray() {}
+    };
+
+    /*
+     * 不经过DOM的重排版Handler：只改写token之间的空白，数字和字符串按原文输出，key保持原有顺序.
+     * 输出先写入out，若指定了stream则每满FLUSH_SIZE字节写出一次，内存占用与文档大小无关.
+     */
+    class Formatter {
+    public:
+        static constexpr size_t FLUSH_SIZE = 64 * 1024;
+
+        Formatter(std::string &out, std::ostream *stream, int indent)
+                : out_(out), stream_(stream), indent_(indent) {}
+
+        void null() {
+            beforeValue();
+            out_.append("null", 4);
+        }
+
+        void boolean(bool b) {
+            beforeValue();
+            if (b)
+                out_.append("true", 4);
+            else
+                out_.append("false", 5);
+        }
+
+        void number(const char *begin, const char *end) {
+            beforeValue();
+            out_.append(begin, end);
+        }
+
+        void string(const StringSpan &span) {
+            beforeValue();
+            quoted(span);
+        }
+
+        void key(const StringSpan &span) {
+            separator();
+            quoted(span);
+            out_.push_back(':');
+            if (indent_ > 0)
+                out_.push_back(' ');
+            afterKey_ = true;
+        }
+
+        void startObject() {
+            open('{');
+        }
+
+        void endObject() {
+            close('}');
+        }
+
+        void startArray() {
+            open('[');
+        }
+
+        void endArray() {
+            close(']');
+        }
+
+        void flush() {
+            if (stream_) {
+                stream_->write(out_.data(), static_cast<std::streamsize>(out_.size()));
+                out_.clear();
+            }
+        }
+
+    private:
+        // key之后的value紧跟在冒号后面，其余value前面需要分隔符.
+        void beforeValue() {
+            if (afterKey_)
+                afterKey_ = false;
+            else
+                separator();
+            if (stream_ && out_.size() >= FLUSH_SIZE)
+                flush();
+        }
+
+        // 容器内第一个成员前只换行缩进，之后的成员前先写逗号.
+        void separator() {
+            if (depth_ == 0)
+                return;
+            if (!first_)
+                out_.push_back(',');
+            first_ = false;
+            newline(depth_);
+        }
+
+        void newline(size_t level) {
+            if (indent_ <= 0)
+                return;
+            out_.push_back('\n');
+            out_.append(level * indent_, ' ');
+        }
+
+        void quoted(const StringSpan &span) {
+            out_.push_back('"');
+            out_.append(span.begin, span.end);
+            out_.push_back('"');
+        }
+
+        void open(char bracket) {
+            beforeValue();
+            out_.push_back(bracket);
+            ++depth_;
+            first_ = true;
+        }
+
+        // 空容器直接闭合为{}或[]，否则先换行回到外层缩进.
+        void close(char bracket) {
+            --depth_;
+            if (!first_)
+                newline(depth_);
+            out_.push_back(bracket);
+            first_ = false;
+        }
+
+        std::string &out_;
+        std::ostream *stream_;
+        int indent_;
+        size_t depth_ = 0;
+        bool first_ = false; // 刚进入一个容器，尚未写出成员
+        bool afterKey_ = false;
+    };
+
+    /*
+     * 把对象数组直接写入JsonColumns的Handler.
+     * level_为1时位于顶层数组中，为2时位于某一行对象中，更深处是被跳过的未选中value.
+     */
+    class ColumnBuilder {
+    public:
+        ColumnBuilder(JsonParserImpl &impl, const std::vector<JsonColumns::Spec> &specs, JsonColumns &table)
+                : impl_(impl), table_(table) {
+            for (const auto &spec : specs) {
+                if (index_.count(spec.name))
+                    throw std::invalid_argument("duplicate column \"" + spec.name + "\"");
+                index_.emplace(spec.name, table_.columns.size());
+                auto &column = table_.columns.emplace_back();
+                column.name = spec.name;
+                column.type = spec.type;
+                if (column.type == JsonColumns::Type::STRING)
+                    column.offsets.push_back(0);
+            }
+            seen_.resize(table_.columns.size());
+        }
+
+        void null() {
+            if (select())
+                appendNull(table_.columns[current_]);
+        }
+
+        void boolean(bool b) {
+            if (select()) {
+                auto &column = accept(JsonColumns::Type::BOOLEAN);
+                column.booleans.push_back(b);
+            }
+        }
+
+        void number(const char *begin, const char *end) {
+            if (!select())
+                return;
+            auto &column = table_.columns[current_];
+            if (column.type == JsonColumns::Type::DOUBLE) {
+                column.doubles.push_back(impl_.toDouble(begin, end));
+            } else if (column.type == JsonColumns::Type::INT64) {
+                int64_t n = 0;
+                auto result = std::from_chars(begin, end, n);
+                if (result.ptr != end)
+                    fail(column, "non-integer number");
+                if (result.ec == std::errc::result_out_of_range)
+                    throw ParseError(ParseError::NUMBER_TOO_BIG, &impl_);
+                column.ints.push_back(n);
             } else {
-                throw ParseError(ParseError::MISS_COMMA_OR_SQUARE_BRACKET, this);
+                fail(column, "number");
             }
         }
-        return ret;
-    }
 
-    // 只为parseJArray/JObject服务，不进行成员变量的存储和skipWhite操作.
-    std::shared_ptr<JElement> parseSingle() {
-        std::shared_ptr<JElement> ret;
-        switch (*p_) {
-            case 't':
-                ret = parseJTrue();
-                break;
-            case 'f':
-                ret = parseJFalse();
-                break;
-            case 'n':
-                ret = parseJNull();
-                break;
-            case '"':
-                ret = parseJString();
-                break;
-            case '{':
-                ret = parseJObject();
-                break;
-            case '[':
-                ret = parseJArray();
-                break;
-            default:
-                ret = parseJNumber();
-                break;
+        void string(const StringSpan &span) {
+            if (!select())
+                return;
+            auto &column = accept(JsonColumns::Type::STRING);
+            if (span.escaped) {
+                impl_.decodeString(span, scratch_);
+                column.blob += scratch_;
+            } else {
+                column.blob.append(span.begin, span.end);
+            }
+            column.offsets.push_back(column.blob.size());
+        }
+
+        void key(const StringSpan &span) {
+            if (level_ != 2)
+                return;
+            std::string_view name;
+            if (span.escaped) {
+                impl_.decodeString(span, scratch_);
+                name = scratch_;
+            } else {
+                name = std::string_view(span.begin, span.end - span.begin);
+            }
+            // 同一数组中各行的key通常顺序相同，先猜测是上一列的下一列
+            current_ = NONE;
+            if (next_ < table_.columns.size() && table_.columns[next_].name == name) {
+                current_ = next_;
+            } else {
+                auto iter = index_.find(name);
+                if (iter != index_.end())
+                    current_ = iter->second;
+            }
+            if (current_ != NONE) {
+                if (seen_[current_])
+                    throw ParseError(ParseError::SCHEMA_MISMATCH, &impl_, "duplicate key \"" + std::string(name) + "\"");
+                seen_[current_] = true;
+                next_ = current_ + 1;
+            }
+        }
+
+        void startObject() {
+            if (level_ == 0)
+                throw ParseError(ParseError::SCHEMA_MISMATCH, &impl_, "columns require an array of objects");
+            if (level_ == 1) {
+                std::fill(seen_.begin(), seen_.end(), false);
+                next_ = 0;
+                ++table_.rows;
+            } else if (select()) {
+                fail(table_.columns[current_], "object");
+            }
+            ++level_;
+        }
+
+        void endObject() {
+            if (--level_ == 1) {
+                for (size_t i = 0; i < seen_.size(); i++)
+                    if (!seen_[i])
+                        appendNull(table_.columns[i]);
+            }
+        }
+
+        void startArray() {
+            if (level_ == 1)
+                throw ParseError(ParseError::SCHEMA_MISMATCH, &impl_, "row is not an object");
+            if (level_ == 2 && select())
+                fail(table_.columns[current_], "array");
+            ++level_;
+        }
+
+        void endArray() {
+            --level_;
+        }
+
+    private:
+        static constexpr size_t NONE = static_cast<size_t>(-1);
+
+        // 当前value是否属于某个选中的列. 顶层数组中的非对象元素直接报错.
+        bool select() {
+            if (level_ == 2)
+                return current_ != NONE;
+            if (level_ < 2)
+                throw ParseError(ParseError::SCHEMA_MISMATCH, &impl_,
+                                 level_ == 0 ? "columns require an array of objects" : "row is not an object");
+            return false;
+        }
+
+        // 当前列能否存放type类型的value.
+        JsonColumns::Column &accept(JsonColumns::Type type) {
+            auto &column = table_.columns[current_];
+            if (column.type != type)
+                fail(column, type == JsonColumns::Type::STRING ? "string" : "boolean");
+            return column;
+        }
+
+        [[noreturn]] void fail(const JsonColumns::Column &column, const char *found) {
+            throw ParseError(ParseError::SCHEMA_MISMATCH, &impl_,
+                             "unexpected " + std::string(found) + " in column \"" + column.name + "\"");
+        }
+
+        void appendNull(JsonColumns::Column &column) {
+            size_t row = table_.rows - 1;
+            if (column.nullBitmap.size() <= row / 64)
+                column.nullBitmap.resize(row / 64 + 1, 0);
+            column.nullBitmap[row / 64] |= uint64_t(1) << (row % 64);
+            switch (column.type) {
+                case JsonColumns::Type::DOUBLE:
+                    column.doubles.push_back(0);
+                    break;
+                case JsonColumns::Type::INT64:
+                    column.ints.push_back(0);
+                    break;
+                case JsonColumns::Type::BOOLEAN:
+                    column.booleans.push_back(0);
+                    break;
+                case JsonColumns::Type::STRING:
+                    column.offsets.push_back(column.blob.size());
+                    break;
+            }
+        }
+
+        JsonParserImpl &impl_;
+        JsonColumns &table_;
+        std::unordered_map<std::string, size_t, StringHash, std::equal_to<>> index_;
+        std::vector<bool> seen_; // 当前行中已出现的列
+        size_t level_ = 0;
+        size_t current_ = NONE; // 当前key对应的列
+        size_t next_ = 0; // 预测的下一列
+        std::string scratch_;
+    };
+
+    /*
+     * 在转发事件给Inner之前按schema检查，遇到第一处不符合即抛出SCHEMA_MISMATCH.
+     * 每层容器对应checks_中的一帧，记录其子schema和已出现的required key.
+     */
+    template<class Inner>
+    class SchemaChecker {
+    public:
+        SchemaChecker(JsonParserImpl &impl, const JsonSchemaImpl &schema, Inner &inner)
+                : impl_(impl), schema_(schema), inner_(inner) {}
+
+        void null() {
+            checkType(JsonSchemaImpl::NUL);
+            checkEnum(JsonSchemaImpl::NUL, 0, {});
+            inner_.null();
+        }
+
+        void boolean(bool b) {
+            checkType(JsonSchemaImpl::BOOLEAN);
+            checkEnum(JsonSchemaImpl::BOOLEAN, b, {});
+            inner_.boolean(b);
+        }
+
+        void number(const char *begin, const char *end) {
+            const auto &node = schema_.nodes[pending_];
+            if (pending_ != JsonSchemaImpl::ANY) {
+                double n = impl_.toDouble(begin, end);
+                unsigned type = JsonSchemaImpl::NUMBER;
+                if (n == std::floor(n))
+                    type |= JsonSchemaImpl::INTEGER;
+                if (!(node.types & type))
+                    fail("type mismatch");
+                checkEnum(JsonSchemaImpl::NUMBER, n, {});
+                if (n < node.minimum)
+                    fail("number less than minimum");
+                if (n > node.maximum)
+                    fail("number greater than maximum");
+            }
+            inner_.number(begin, end);
+        }
+
+        void string(const StringSpan &span) {
+            const auto &node = schema_.nodes[pending_];
+            if (pending_ != JsonSchemaImpl::ANY) {
+                checkType(JsonSchemaImpl::STRING);
+                std::string_view str = decoded(span);
+                checkEnum(JsonSchemaImpl::STRING, 0, str);
+                if (node.maxLength < str.size()) {
+                    // maxLength按码点计数，即不计UTF-8的后续字节
+                    size_t length = 0;
+                    for (char ch : str)
+                        length += (static_cast<unsigned char>(ch) & 0xC0) != 0x80;
+                    if (length > node.maxLength)
+                        fail("string longer than maxLength");
+                }
+            }
+            inner_.string(span);
+        }
+
+        void key(const StringSpan &span) {
+            Check &check = checks_[depth_ - 1];
+            const auto &node = schema_.nodes[check.node];
+            pending_ = JsonSchemaImpl::ANY;
+            if (!node.members.empty()) {
+                auto iter = node.members.find(decoded(span));
+                if (iter != node.members.end()) {
+                    pending_ = iter->second.node;
+                    if (iter->second.requiredIndex != JsonSchemaImpl::NO_REQUIRED)
+                        check.seen[iter->second.requiredIndex] = true;
+                }
+            }
+            inner_.key(span);
+        }
+
+        void startObject() {
+            checkType(JsonSchemaImpl::OBJECT);
+            checkEnum(JsonSchemaImpl::OBJECT, 0, {});
+            Check &check = push();
+            check.seen.assign(schema_.nodes[check.node].required.size(), false);
+            inner_.startObject();
+        }
+
+        void endObject() {
+            const Check &check = checks_[depth_ - 1];
+            const auto &required = schema_.nodes[check.node].required;
+            for (size_t i = 0; i < required.size(); i++)
+                if (!check.seen[i])
+                    fail("required key \"" + required[i] + "\" missing");
+            pop();
+            inner_.endObject();
+        }
+
+        void startArray() {
+            checkType(JsonSchemaImpl::ARRAY);
+            checkEnum(JsonSchemaImpl::ARRAY, 0, {});
+            pending_ = schema_.nodes[push().node].items;
+            inner_.startArray();
+        }
+
+        void endArray() {
+            pop();
+            inner_.endArray();
+        }
+
+    private:
+        struct Check {
+            size_t node;
+            std::vector<bool> seen; // 与node.required一一对应
+        };
+
+        [[noreturn]] void fail(const std::string &detail) {
+            throw ParseError(ParseError::SCHEMA_MISMATCH, &impl_, detail);
         }
-        return ret;
-    }
+
+        void checkType(unsigned type) {
+            if (!(schema_.nodes[pending_].types & type))
+                fail("type mismatch");
+        }
+
+        void checkEnum(unsigned type, double number, std::string_view str) {
+            const auto &node = schema_.nodes[pending_];
+            if (!node.hasEnum)
+                return;
+            for (const auto &value : node.enumValues)
+                if (value.type == type && value.number == number && value.str == str)
+                    return;
+            fail("value not in enum");
+        }
+
+        std::string_view decoded(const StringSpan &span) {
+            if (!span.escaped)
+                return {span.begin, static_cast<size_t>(span.end - span.begin)};
+            impl_.decodeString(span, scratch_);
+            return scratch_;
+        }
+
+        Check &push() {
+            if (depth_ == checks_.size())
+                checks_.emplace_back();
+            Check &check = checks_[depth_++];
+            check.node = pending_;
+            return check;
+        }
+
+        // 容器闭合后，若外层是array，下一个元素仍按其items检查；外层是object时由下一个key决定.
+        void pop() {
+            if (--depth_ > 0)
+                pending_ = schema_.nodes[checks_[depth_ - 1].node].items;
+        }
+
+        JsonParserImpl &impl_;
+        const JsonSchemaImpl &schema_;
+        Inner &inner_;
+        size_t pending_ = JsonSchemaImpl::ROOT; // 下一个值对应的子schema
+        std::vector<Check> checks_;
+        size_t depth_ = 0;
+        std::string scratch_; // 含转义的字符串解码后再比较
+    };
 
 public:
     JsonParserImpl() {
-        buffer_.reserve(50);
+        stack_.reserve(64);
     }
 
-    std::shared_ptr<JElement> parse(const std::string &str) {
-        std::shared_ptr<JElement> ret;
-        str_ = str;
-        p_ = str_.data();
-        skipWhite();
-        switch (*p_) {
-            case 't':
-                ret = parseJTrue();
-                break;
-            case 'f':
-                ret = parseJFalse();
-                break;
-            case 'n':
-                ret = parseJNull();
-                break;
-            case '"':
-                ret = parseJString();
-                break;
-            case '{':
-                ret = parseJObject();
-                break;
-            case '[':
-                ret = parseJArray();
-                break;
-            default:
-                ret = parseJNumber();
-                break;
+    std::shared_ptr<JElement> parse(std::string_view str) {
+        DomBuilder builder(*this);
+        parseDocument(str, builder);
+        return builder.result();
+    }
+
+    std::shared_ptr<JElement> parseZeroCopy(std::shared_ptr<const std::string> input) {
+        DomBuilder builder(*this, input);
+        parseDocument(*input, builder);
+        return builder.result();
+    }
+
+    void validate(std::string_view str) {
+        Validator validator;
+        parseDocument(str, validator);
+    }
+
+    // 只需要结果：出错时ParseError不拼接错误信息，避免在非法输入上复制整个输入
+    bool isValid(std::string_view str) {
+        struct Quiet {
+            bool &flag;
+            ~Quiet() { flag = false; }
+        } quiet{quietErrors_};
+        quietErrors_ = true;
+        try {
+            validate(str);
+            return true;
+        } catch (ParseError &) {
+            return false;
         }
-        skipWhite();
-        if (*p_ != '\0')
-            throw ParseError(ParseError::REDUNDANT_CHARS, this);
-        return ret;
+    }
+
+    std::shared_ptr<JElement> parse(std::string_view str, const JsonSchemaImpl &schema) {
+        DomBuilder builder(*this);
+        SchemaChecker<DomBuilder> checker(*this, schema, builder);
+        parseDocument(str, checker);
+        return builder.result();
+    }
+
+    void validate(std::string_view str, const JsonSchemaImpl &schema) {
+        Validator validator;
+        SchemaChecker<Validator> checker(*this, schema, validator);
+        parseDocument(str, checker);
+    }
+
+    JsonColumns parseColumns(std::string_view str, const std::vector<JsonColumns::Spec> &specs) {
+        JsonColumns table;
+        ColumnBuilder builder(*this, specs, table);
+        parseDocument(str, builder);
+        // 末尾没有null的列也补齐位图，使每列的nullBitmap长度一致
+        for (auto &column : table.columns)
+            column.nullBitmap.resize((table.rows + 63) / 64, 0);
+        return table;
+    }
+
+    void format(std::string_view str, std::string &out, std::ostream *stream, int indent) {
+        if (stream)
+            out.reserve(2 * Formatter::FLUSH_SIZE);
+        Formatter formatter(out, stream, indent);
+        parseDocument(str, formatter);
+        formatter.flush();
+    }
+
+    /*
+     * 从read读取的字节流中逐个切出顶层元素并解析. read返回0表示输入结束.
+     * 切分只跟踪括号深度和字符串状态以找到元素的结尾，元素本身的语法由parse完整校验.
+     */
+    JsonStream stream(std::function<size_t(char *, size_t)> read, size_t chunkSize) {
+        return stream(std::move(read), chunkSize, settings_);
+    }
+
+    void setMaxDepth(size_t depth) {
+        settings_.maxDepth = depth;
+    }
+
+    size_t maxDepth() const {
+        return settings_.maxDepth;
+    }
+
+    void setLazyNumbers(bool lazy) {
+        settings_.lazyNumbers = lazy;
+    }
+
+    void setKeyTable(std::shared_ptr<JsonKeyTable> table) {
+        if (!table)
+            throw std::invalid_argument("key table must not be null");
+        settings_.keyTable = std::move(table);
+        keyCache_.fill(JKey());
+    }
+
+    std::shared_ptr<JsonKeyTable> keyTable() const {
+        return settings_.keyTable;
     }
 
 private:
     friend class ParseError;
 
-    const char *p_; // 指向当前的处理位置，in [str_.begin(), str_.end()]
-    std::string str_; // 保存str副本，供ParseError使用
-    std::vector<char> buffer_; // 缓冲区，供parseJString使用
+    // 以str中offset处为错误位置抛出ParseError，供不经过parseDocument的流式切分使用.
+    [[noreturn]] void fail(ParseError::Error e, std::string_view str, size_t offset) {
+        str_ = str;
+        p_ = str_.data() + offset;
+        end_ = str_.data() + str_.size();
+        throw ParseError(e, this);
+    }
+
+    const char *p_ = nullptr; // 指向当前的处理位置，in [str_.begin(), str_.end()]
+    const char *end_ = nullptr; // 输入的末尾，即str_.end()
+    std::string_view str_; // 当前输入，供ParseError使用，只在一次解析期间有效
+    bool quietErrors_ = false; // 为true时ParseError不生成错误信息，见isValid
+    std::vector<char> stack_; // parseValue的显式栈，记录每层容器是'{'还是'['
+    std::vector<Frame> frames_; // DomBuilder的容器栈，跨parse调用复用
+    /*
+     * 先查本parser独占的直接映射缓存，命中时不需要对共享的keyTable加锁.
+     * 缓存中的key都来自keyTable（或表满后单独分配），更换keyTable时清空.
+     */
+    JKey intern(std::string_view name) {
+        size_t hash = JKey::Hash()(name);
+        auto &slot = keyCache_[hash % KEY_CACHE_SIZE];
+        if (slot.hash() != hash || slot.str() != name)
+            slot = settings_.keyTable->intern(name);
+        return slot;
+    }
+
+    static constexpr size_t KEY_CACHE_SIZE = 256;
+    std::array<JKey, KEY_CACHE_SIZE> keyCache_;
+
+    // 用户可配置的选项，流式解析时整体复制给协程内部的JsonParserImpl
+    struct Settings {
+        size_t maxDepth = JsonParser::DEFAULT_MAX_DEPTH; // 允许的最大容器嵌套层数
+        bool lazyNumbers = false; // DomBuilder是否只保存数字原文
+        std::shared_ptr<JsonKeyTable> keyTable = std::make_shared<JsonKeyTable>(); // 驻留object key
+    };
+
+    Settings settings_;
+
+    // 协程按值持有settings，与创建它的JsonParser的生命周期无关.
+    static JsonStream stream(std::function<size_t(char *, size_t)> read, size_t chunkSize, Settings settings);
 };
 
-ParseError::ParseError(Error e, JsonParserImpl *impl) {
+ParseError::ParseError(Error e, JsonParserImpl *impl, const std::string &detail) {
+    if (impl->quietErrors_)
+        return;
     switch (e) {
         case INVALID_VALUE:
             msg_ = "invalid value";
@@ -352,20 +1263,579 @@ ParseError::ParseError(Error e, JsonParserImpl *impl) {
         case REDUNDANT_COMMA:
             msg_ = "redundant comma";
             break;
+        case NESTING_TOO_DEEP:
+            msg_ = "nesting too deep";
+            break;
+        case INVALID_UTF8_CHAR:
+            msg_ = "invalid utf8 char";
+            break;
+        case SCHEMA_MISMATCH:
+            msg_ = "schema mismatch";
+            break;
         default:
             msg_ = "wtf?";
             break;
     }
+    if (!detail.empty())
+        msg_ += " (" + detail + ")";
     msg_ += ". which near:\n";
-    msg_ += impl->str_ + "\n";
+    msg_ += impl->str_;
+    msg_ += "\n";
     msg_ += std::string(impl->p_ - impl->str_.data(), ' ') + "^\n";
 }
 
+JsonStream JsonParserImpl::stream(std::function<size_t(char *, size_t)> read, size_t chunkSize, Settings settings) {
+    JsonParserImpl impl;
+    impl.settings_ = std::move(settings);
+    std::string buffer;
+    size_t start = 0; // 当前元素在buffer中的起点，之前的内容已处理完毕
+    size_t pos = 0;
+    bool eof = false;
+
+    // 丢弃已处理的内容后再读入一个chunk，返回是否读到了新数据.
+    auto fill = [&]() {
+        if (eof)
+            return false;
+        buffer.erase(0, start);
+        pos -= start;
+        start = 0;
+        size_t old = buffer.size();
+        buffer.resize(old + chunkSize);
+        size_t n = read(buffer.data() + old, chunkSize);
+        buffer.resize(old + n);
+        eof = n == 0;
+        return n > 0;
+    };
+    auto isWhite = [](char ch) {
+        return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+    };
+    // 跳过空白，返回之后是否还有字符.
+    auto skipWhite = [&]() {
+        for (;;) {
+            while (pos < buffer.size() && isWhite(buffer[pos]))
+                ++pos;
+            if (pos < buffer.size())
+                return true;
+            start = pos;
+            if (!fill())
+                return false;
+        }
+    };
+    // 返回从start开始的元素的结尾. 元素未闭合就遇到输入结束时返回buffer末尾，交给parse报错.
+    auto findElementEnd = [&]() {
+        size_t i = 0; // 相对start的偏移，fill移动buffer后仍然有效
+        size_t depth = 0;
+        bool inString = false, escape = false;
+        char first = buffer[start];
+        bool scalar = first != '{' && first != '[' && first != '"';
+        for (;;) {
+            for (; start + i < buffer.size(); i++) {
+                char ch = buffer[start + i];
+                if (scalar) {
+                    if (isWhite(ch) || ch == ',' || ch == ']' || ch == '}' || ch == '[' || ch == '{' || ch == '"')
+                        return start + i;
+                } else if (inString) {
+                    if (escape)
+                        escape = false;
+                    else if (ch == '\\')
+                        escape = true;
+                    else if (ch == '"') {
+                        inString = false;
+                        if (depth == 0)
+                            return start + i + 1;
+                    }
+                } else if (ch == '"') {
+                    inString = true;
+                } else if (ch == '{' || ch == '[') {
+                    ++depth;
+                } else if ((ch == '}' || ch == ']') && --depth == 0) {
+                    return start + i + 1;
+                }
+            }
+            if (!fill())
+                return buffer.size();
+        }
+    };
+
+    if (!skipWhite())
+        co_return;
+    bool inArray = buffer[pos] == '[';
+    if (inArray) {
+        ++pos;
+        if (!skipWhite())
+            impl.fail(ParseError::MISS_COMMA_OR_SQUARE_BRACKET, buffer, pos);
+    }
+    if (!inArray || buffer[pos] != ']') {
+        for (;;) {
+            start = pos;
+            size_t end = findElementEnd();
+            co_yield impl.parse(std::string_view(buffer).substr(start, end - start));
+            pos = end;
+            if (!inArray) {
+                if (!skipWhite())
+                    co_return;
+                continue;
+            }
+            if (!skipWhite())
+                impl.fail(ParseError::MISS_COMMA_OR_SQUARE_BRACKET, buffer, pos);
+            if (buffer[pos] == ',') {
+                ++pos;
+                if (!skipWhite())
+                    impl.fail(ParseError::REDUNDANT_COMMA, buffer, pos);
+            } else if (buffer[pos] == ']') {
+                break;
+            } else {
+                impl.fail(ParseError::MISS_COMMA_OR_SQUARE_BRACKET, buffer, pos);
+            }
+        }
+    }
+    ++pos;
+    if (skipWhite())
+        impl.fail(ParseError::REDUNDANT_CHARS, buffer, pos);
+}
+
+JsonStream::JsonStream(JsonStream &&other) noexcept
+        : handle_(std::exchange(other.handle_, nullptr)), started_(other.started_) {}
+
+JsonStream &JsonStream::operator=(JsonStream &&other) noexcept {
+    if (this != &other) {
+        if (handle_)
+            handle_.destroy();
+        handle_ = std::exchange(other.handle_, nullptr);
+        started_ = other.started_;
+    }
+    return *this;
+}
+
+JsonStream::~JsonStream() {
+    if (handle_)
+        handle_.destroy();
+}
+
+JsonStream::iterator JsonStream::begin() {
+    if (!started_) {
+        started_ = true;
+        resume();
+    }
+    return iterator(this);
+}
+
+void JsonStream::resume() {
+    handle_.resume();
+    if (handle_.done() && handle_.promise().exception)
+        std::rethrow_exception(std::exchange(handle_.promise().exception, nullptr));
+}
+
 JsonParser::JsonParser() : impl_(std::make_unique<JsonParserImpl>()) {}
 
 JsonParser::~JsonParser() = default;
 
+std::shared_ptr<JElement> JsonParser::parse(const char *s, size_t len) {
+    return impl_->parse(std::string_view(s, len));
+}
+
 std::shared_ptr<JElement> JsonParser::parse(const std::string &str) {
     return impl_->parse(str);
 }
 
+std::shared_ptr<JElement> JsonParser::parseZeroCopy(std::shared_ptr<const std::string> input) {
+    return impl_->parseZeroCopy(std::move(input));
+}
+
+void JsonParser::validate(std::string_view str) {
+    impl_->validate(str);
+}
+
+bool JsonParser::isValid(std::string_view str) {
+    return impl_->isValid(str);
+}
+
+void JsonParser::format(std::string_view str, std::ostream &out, int indent) {
+    std::string buffer;
+    impl_->format(str, buffer, &out, indent);
+}
+
+std::string JsonParser::minify(std::string_view str) {
+    std::string out;
+    out.reserve(str.size());
+    impl_->format(str, out, nullptr, 0);
+    return out;
+}
+
+std::string JsonParser::prettify(std::string_view str, int indent) {
+    std::string out;
+    out.reserve(str.size());
+    impl_->format(str, out, nullptr, indent);
+    return out;
+}
+
+JsonColumns JsonParser::parseColumns(std::string_view str, const std::vector<JsonColumns::Spec> &specs) {
+    return impl_->parseColumns(str, specs);
+}
+
+void JsonParser::setKeyTable(std::shared_ptr<JsonKeyTable> table) {
+    impl_->setKeyTable(std::move(table));
+}
+
+std::shared_ptr<JsonKeyTable> JsonParser::keyTable() const {
+    return impl_->keyTable();
+}
+
+void JsonParser::setLazyNumbers(bool lazy) {
+    impl_->setLazyNumbers(lazy);
+}
+
+JsonStream JsonParser::stream(std::istream &in, size_t chunkSize) {
+    return impl_->stream([&in](char *buf, size_t len) {
+        in.read(buf, static_cast<std::streamsize>(len));
+        if (in.bad())
+            throw std::ios_base::failure("read failed.");
+        return static_cast<size_t>(in.gcount());
+    }, chunkSize);
+}
+
+JsonStream JsonParser::stream(int fd, size_t chunkSize) {
+    return impl_->stream([fd](char *buf, size_t len) {
+        for (;;) {
+            ssize_t n = ::read(fd, buf, len);
+            if (n >= 0)
+                return static_cast<size_t>(n);
+            if (errno != EINTR)
+                throw std::system_error(errno, std::generic_category(), "read failed.");
+        }
+    }, chunkSize);
+}
+
+JsonStream JsonParser::streamFrom(std::function<size_t(char *, size_t)> read, size_t chunkSize) {
+    return impl_->stream(std::move(read), chunkSize);
+}
+
+void JsonParser::setMaxDepth(size_t depth) {
+    impl_->setMaxDepth(depth);
+}
+
+size_t JsonParser::maxDepth() const {
+    return impl_->maxDepth();
+}
+
+std::shared_ptr<JElement> JsonParser::parse(const std::string &str, const JsonSchema &schema) {
+    return impl_->parse(str, *schema.impl_);
+}
+
+void JsonParser::validate(std::string_view str, const JsonSchema &schema) {
+    impl_->validate(str, *schema.impl_);
+}
+
+// 按JSON Schema的语义，不认识的关键字一律忽略；认识但用法不支持的关键字抛出invalid_argument.
+size_t JsonSchemaImpl::compile(const std::shared_ptr<JElement> &schema) {
+    size_t index = nodes.size();
+    nodes.emplace_back();
+    if (schema->isJTrue())
+        return index;
+    if (schema->isJFalse()) {
+        nodes[index].types = 0;
+        return index;
+    }
+    if (!schema->isJObject())
+        throw std::invalid_argument("schema must be an object or a boolean");
+    auto object = schema->getAsObject();
+
+    if (object->hasKey("type")) {
+        auto type = object->getElement("type");
+        std::vector<std::shared_ptr<JElement>> names;
+        if (type->isJArray()) {
+            for (size_t i = 0; i < type->getAsArray()->size(); i++)
+                names.push_back(type->getAsArray()->getElement(i));
+        } else {
+            names.push_back(type);
+        }
+        unsigned types = 0;
+        for (const auto &name : names) {
+            if (!name->isJString())
+                throw std::invalid_argument("\"type\" must be a string or an array of strings");
+            auto str = name->getAsString();
+            if (str == "null") types |= NUL;
+            else if (str == "boolean") types |= BOOLEAN;
+            else if (str == "object") types |= OBJECT;
+            else if (str == "array") types |= ARRAY;
+            else if (str == "string") types |= STRING;
+            else if (str == "number") types |= NUMBER | INTEGER;
+            else if (str == "integer") types |= INTEGER;
+            else throw std::invalid_argument("unknown type \"" + str + "\"");
+        }
+        nodes[index].types = types;
+    }
+
+    if (object->hasKey("properties")) {
+        auto properties = object->getElement("properties");
+        if (!properties->isJObject())
+            throw std::invalid_argument("\"properties\" must be an object");
+        for (const auto &pair : properties->getAsObject()->pairs()) {
+            size_t child = compile(pair.second);
+            nodes[index].members[pair.first.str()].node = child;
+        }
+    }
+
+    if (object->hasKey("required")) {
+        auto required = object->getElement("required");
+        if (!required->isJArray())
+            throw std::invalid_argument("\"required\" must be an array of strings");
+        for (size_t i = 0; i < required->getAsArray()->size(); i++) {
+            auto key = required->getAsArray()->getElement(i);
+            if (!key->isJString())
+                throw std::invalid_argument("\"required\" must be an array of strings");
+            Node &node = nodes[index];
+            Member &member = node.members[key->getAsString()];
+            if (member.requiredIndex == NO_REQUIRED) {
+                member.requiredIndex = node.required.size();
+                node.required.push_back(key->getAsString());
+            }
+        }
+    }
+
+    if (object->hasKey("items")) {
+        auto items = object->getElement("items");
+        if (items->isJArray())
+            throw std::invalid_argument("tuple \"items\" is not supported");
+        size_t child = compile(items);
+        nodes[index].items = child;
+    }
+
+    if (object->hasKey("enum")) {
+        auto values = object->getElement("enum");
+        if (!values->isJArray())
+            throw std::invalid_argument("\"enum\" must be an array");
+        Node &node = nodes[index];
+        node.hasEnum = true;
+        for (size_t i = 0; i < values->getAsArray()->size(); i++) {
+            auto value = values->getAsArray()->getElement(i);
+            if (value->isJNull())
+                node.enumValues.push_back({NUL, 0, {}});
+            else if (value->isJTrue() || value->isJFalse())
+                node.enumValues.push_back({BOOLEAN, static_cast<double>(value->getAsBoolean()), {}});
+            else if (value->isNumber())
+                node.enumValues.push_back({NUMBER, value->getAsDouble(), {}});
+            else if (value->isJString())
+                node.enumValues.push_back({STRING, 0, value->getAsString()});
+            else
+                throw std::invalid_argument("only scalar \"enum\" values are supported");
+        }
+    }
+
+    auto number = [&object](const char *keyword) {
+        auto value = object->getElement(keyword);
+        if (!value->isNumber())
+            throw std::invalid_argument(std::string("\"") + keyword + "\" must be a number");
+        return value->getAsDouble();
+    };
+    if (object->hasKey("minimum"))
+        nodes[index].minimum = number("minimum");
+    if (object->hasKey("maximum"))
+        nodes[index].maximum = number("maximum");
+    if (object->hasKey("maxLength")) {
+        double maxLength = number("maxLength");
+        if (maxLength < 0 || maxLength != std::floor(maxLength))
+            throw std::invalid_argument("\"maxLength\" must be a non-negative integer");
+        nodes[index].maxLength = static_cast<size_t>(maxLength);
+    }
+    return index;
+}
+
+JsonSchema JsonSchema::compile(const std::shared_ptr<JElement> &schema) {
+    auto impl = std::make_shared<JsonSchemaImpl>();
+    impl->nodes.emplace_back(); // ANY
+    impl->compile(schema);
+    JsonSchema ret;
+    ret.impl_ = std::move(impl);
+    return ret;
+}
+
+JsonSchema JsonSchema::compile(const std::string &schema) {
+    return compile(JsonParser().parse(schema));
+}
+
+struct JsonDocumentCacheImpl {
+    struct Entry {
+        size_t hash;
+        std::shared_ptr<const std::string> input;
+        std::shared_ptr<JElement> document;
+        size_t bytes;
+    };
+
+    explicit JsonDocumentCacheImpl(size_t capacity) : capacity(capacity) {}
+
+    // 估算document占用的内存. 引用input的零拷贝字符串不重复计入
+    static size_t estimate(JElement &element, const std::string &input);
+
+    // 调用时须持有mutex
+    std::list<Entry>::iterator find(size_t hash, std::string_view str) {
+        auto range = index.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            const std::string &saved = *it->second->input;
+            if (saved.size() == str.size() && memcmp(saved.data(), str.data(), str.size()) == 0)
+                return it->second;
+        }
+        return lru.end();
+    }
+
+    // 调用时须持有mutex
+    void evict(std::list<Entry>::iterator it) {
+        auto range = index.equal_range(it->hash);
+        for (auto i = range.first; i != range.second; ++i) {
+            if (i->second == it) {
+                index.erase(i);
+                break;
+            }
+        }
+        bytes -= it->bytes;
+        lru.erase(it);
+    }
+
+    const size_t capacity;
+    mutable std::mutex mutex;
+    std::list<Entry> lru; // 表头为最近使用
+    std::unordered_multimap<size_t, std::list<Entry>::iterator> index;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t maxDepth = JsonParser::DEFAULT_MAX_DEPTH;
+    bool lazyNumbers = false;
+    std::shared_ptr<JsonKeyTable> keyTable = std::make_shared<JsonKeyTable>(); // 所有缓存文档共用
+};
+
+size_t JsonDocumentCacheImpl::estimate(JElement &element, const std::string &input) {
+    // make_shared的控制块与对象在同一次分配中
+    constexpr size_t CONTROL_BLOCK = 2 * sizeof(long);
+    // 长度为size的std::string在堆上额外占用的内存，放得下内联缓冲区时为0
+    auto heapString = [](size_t size) {
+        return size > std::string().capacity() ? size + 1 : 0;
+    };
+    switch (element.type()) {
+        case JElement::JType::JOBJECT: {
+            auto &object = element.getAsObjectRef();
+            size_t ret = CONTROL_BLOCK + sizeof(JObject) + object.pairs().bucket_count() * sizeof(void *);
+            for (const auto &pair : object) {
+                // 哈希表节点：next指针 + pair + 缓存的哈希值. 驻留的key由key表共享，不计入
+                ret += sizeof(void *) + sizeof(pair) + sizeof(size_t);
+                ret += estimate(*pair.second, input);
+            }
+            return ret;
+        }
+        case JElement::JType::JARRAY: {
+            auto &array = element.getAsArrayRef();
+            size_t ret = CONTROL_BLOCK + sizeof(JArray) + array.elements().capacity() * sizeof(std::shared_ptr<JElement>);
+            for (const auto &e : array)
+                ret += estimate(*e, input);
+            return ret;
+        }
+        case JElement::JType::JSTRING: {
+            std::string_view view = element.getAsStringView();
+            // 引用input的字符串由JString::NewView创建，多出view和owner两个成员
+            if (view.data() >= input.data() && view.data() + view.size() <= input.data() + input.size())
+                return CONTROL_BLOCK + sizeof(JString) + sizeof(std::string_view) + sizeof(std::shared_ptr<const void>);
+            return CONTROL_BLOCK + sizeof(JString) + heapString(view.size());
+        }
+        case JElement::JType::JNUMBER: {
+            auto &number = static_cast<JNumber &>(element);
+            if (!number.hasRaw())
+                return CONTROL_BLOCK + sizeof(JNumber);
+            // 惰性数字：引用input时多出原文的view和owner，否则原文放在节点内32字节的缓冲区中，放不下时另行分配
+            std::string_view raw = number.getRaw();
+            size_t ret = CONTROL_BLOCK + sizeof(JNumber) + sizeof(std::string_view);
+            if (raw.data() >= input.data() && raw.data() + raw.size() <= input.data() + input.size())
+                return ret + sizeof(std::shared_ptr<const void>);
+            return ret + 32 + sizeof(std::unique_ptr<char[]>) + (raw.size() > 32 ? raw.size() : 0);
+        }
+        case JElement::JType::JNULL:
+            return CONTROL_BLOCK + sizeof(JNull);
+        case JElement::JType::JTRUE:
+            return CONTROL_BLOCK + sizeof(JTrue);
+        case JElement::JType::JFALSE:
+            return CONTROL_BLOCK + sizeof(JFalse);
+    }
+    return 0;
+}
+
+JsonDocumentCache::JsonDocumentCache(size_t capacity) : impl_(std::make_unique<JsonDocumentCacheImpl>(capacity)) {}
+
+JsonDocumentCache::~JsonDocumentCache() = default;
+
+std::shared_ptr<JElement> JsonDocumentCache::parse(std::string_view str) {
+    size_t hash = std::hash<std::string_view>()(str);
+    size_t maxDepth;
+    bool lazyNumbers;
+    {
+        std::lock_guard<std::mutex> lock(impl_->mutex);
+        auto it = impl_->find(hash, str);
+        if (it != impl_->lru.end()) {
+            impl_->hits++;
+            impl_->lru.splice(impl_->lru.begin(), impl_->lru, it);
+            return it->document;
+        }
+        impl_->misses++;
+        maxDepth = impl_->maxDepth;
+        lazyNumbers = impl_->lazyNumbers;
+    }
+
+    // 输入副本既用于命中时的比较，也作为零拷贝字符串的存储，不会多占一份内存
+    auto input = std::make_shared<const std::string>(str);
+    JsonParser parser;
+    parser.setMaxDepth(maxDepth);
+    parser.setLazyNumbers(lazyNumbers);
+    parser.setKeyTable(impl_->keyTable);
+    auto document = parser.parseZeroCopy(input);
+    // 放入缓存前算好并缓存各子树的哈希，此后对共享文档的hash(true)只读不写，可以并发调用
+    document->hash(true);
+    size_t bytes = sizeof(JsonDocumentCacheImpl::Entry) + input->capacity() + JsonDocumentCacheImpl::estimate(*document, *input);
+    if (bytes > impl_->capacity)
+        return document;
+
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    // 解析期间其他线程可能已放入相同的文档，此时返回已缓存的那一份
+    auto it = impl_->find(hash, str);
+    if (it != impl_->lru.end()) {
+        impl_->lru.splice(impl_->lru.begin(), impl_->lru, it);
+        return it->document;
+    }
+    while (impl_->bytes + bytes > impl_->capacity) {
+        impl_->evict(std::prev(impl_->lru.end()));
+        impl_->evictions++;
+    }
+    impl_->lru.push_front({hash, std::move(input), document, bytes});
+    impl_->index.emplace(hash, impl_->lru.begin());
+    impl_->bytes += bytes;
+    return document;
+}
+
+JsonDocumentCache::Stats JsonDocumentCache::stats() const {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    Stats ret;
+    ret.hits = impl_->hits;
+    ret.misses = impl_->misses;
+    ret.evictions = impl_->evictions;
+    ret.entries = impl_->lru.size();
+    ret.bytes = impl_->bytes;
+    return ret;
+}
+
+size_t JsonDocumentCache::capacity() const {
+    return impl_->capacity;
+}
+
+void JsonDocumentCache::clear() {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    impl_->lru.clear();
+    impl_->index.clear();
+    impl_->bytes = 0;
+}
+
+void JsonDocumentCache::setMaxDepth(size_t depth) {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    impl_->maxDepth = depth;
+}
+
+void JsonDocumentCache::setLazyNumbers(bool lazy) {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    impl_->lazyNumbers = lazy;
+}
@@ -1,6 +1,12 @@
 #include <gtest/gtest.h>
 #include "JsonParser.h"
 #include <iostream>
+#include <sstream>
+#include <fstream>
+#include <unordered_set>
+#include <unistd.h>
+#include <thread>
+#include <zlib.h>
 
 
 TEST(Renderer, BaseTypes) {
@@ -62,6 +68,69 @@ TEST(Renderer, ArrayType) {
     EXPECT_THROW(ja.removeElement(1), std::out_of_range);
 }
 
+TEST(Renderer, EqualsAndHash) {
+    JsonParser parser;
+    auto a = parser.parse("{\"id\": 1, \"tags\": [\"x\", \"y\"], \"meta\": {\"k\": null, \"v\": -0}}");
+    auto b = parser.parse("{\"meta\": {\"v\": 0, \"k\": null}, \"tags\": [\"x\", \"y\"], \"id\": 1.0}");
+    EXPECT_TRUE(a->equals(*b));
+    EXPECT_EQ(a->hash(), b->hash());
+    EXPECT_EQ(a->hash(true), b->hash());
+
+    EXPECT_FALSE(a->equals(*parser.parse("{\"id\": 1, \"tags\": [\"y\", \"x\"], \"meta\": {\"k\": null, \"v\": 0}}")));
+    EXPECT_FALSE(a->equals(*parser.parse("{\"id\": 1, \"tags\": [\"x\", \"y\"]}")));
+    EXPECT_FALSE(parser.parse("[1, \"1\"]")->equals(*parser.parse("[\"1\", 1]")));
+    EXPECT_FALSE(parser.parse("true")->equals(*parser.parse("false")));
+    EXPECT_NE(parser.parse("[1, 2]")->hash(), parser.parse("[2, 1]")->hash());
+    EXPECT_NE(parser.parse("{\"a\": 1, \"b\": 2}")->hash(), parser.parse("{\"a\": 2, \"b\": 1}")->hash());
+    EXPECT_TRUE(parser.parse("{\"a\": 1, \"a\": 2}")->equals(*parser.parse("{\"a\": 2, \"a\": 1}")));
+    EXPECT_FALSE(parser.parse("{\"a\": 1, \"a\": 1}")->equals(*parser.parse("{\"a\": 1, \"a\": 2}")));
+
+    // 容器自身的修改会使缓存的哈希失效
+    auto c = parser.parse("{\"id\": 1}")->getAsObject();
+    uint64_t before = c->hash(true);
+    c->addElement("x", JNull::New());
+    EXPECT_NE(c->hash(true), before);
+
+    std::unordered_set<std::shared_ptr<JElement>, JElementHash, JElementEqual> events;
+    events.insert(a);
+    events.insert(b);
+    events.insert(parser.parse("{\"id\": 2}"));
+    EXPECT_EQ(events.size(), 2);
+}
+
+TEST(Renderer, BorrowingAccessors) {
+    JsonParser parser;
+    auto doc = parser.parse("{\"name\": \"borrowed\", \"list\": [1, 2, 3], \"dup\": 1, \"dup\": 2}");
+    JObject &jo = doc->getAsObjectRef();
+    EXPECT_EQ(&jo.pairs(), &jo.pairs()); // 不再返回拷贝
+    size_t members = 0;
+    for (const auto &[key, value] : jo)
+        members += !key.str().empty() && value != nullptr;
+    EXPECT_EQ(members, 4);
+
+    EXPECT_EQ(jo.findElement("name")->getAsStringView(), "borrowed");
+    EXPECT_EQ(jo.findElement("missing"), nullptr);
+    long use = doc.use_count();
+    JArray &list = jo.findElement("list")->getAsArrayRef();
+    double sum = 0;
+    for (const auto &e : list)
+        sum += e->getAsDouble();
+    EXPECT_EQ(sum, 6.0);
+    EXPECT_EQ(list.at(2)->getAsDouble(), 3.0);
+    EXPECT_EQ(&list.at(0), &list.elements()[0]);
+    EXPECT_EQ(doc.use_count(), use);
+    EXPECT_THROW(list.at(3), std::out_of_range);
+    EXPECT_THROW(list.at(0)->getAsObjectRef(), std::bad_cast);
+    EXPECT_THROW(list.at(0)->getAsStringView(), std::bad_cast);
+
+    auto range = jo.getMultiElements("dup");
+    EXPECT_EQ(std::distance(range.first, range.second), 2);
+    EXPECT_THROW(jo.getMultiElements("none"), std::out_of_range);
+
+    JString js("view");
+    EXPECT_EQ(js.getView(), "view");
+}
+
 TEST(Parser, BaseTypes) {
     JsonParser parser;
     auto ret = parser.parse("null");
@@ -89,6 +158,30 @@ TEST(Parser, StringType) {
     EXPECT_THROW(parser.parse("\"\\u0G00\""), ParseError);
 }
 
+TEST(Parser, ZeroCopyStrings) {
+    JsonParser parser;
+    std::string longText = "a fairly long string value without escapes";
+    auto input = std::make_shared<const std::string>("{\"long\": \"" + longText + "\", \"short\": \"abc\", "
+                                                    "\"escaped\": \"line\\nbreak and more than sixteen bytes\"}");
+    auto jo = parser.parseZeroCopy(input)->getAsObject();
+    std::weak_ptr<const std::string> weak = input;
+    input.reset();
+    EXPECT_FALSE(weak.expired()); // 文档持有输入
+    EXPECT_EQ(jo->getElement("long")->getAsString(), longText);
+    EXPECT_EQ(jo->getElement("long")->toJson(), "\"" + longText + "\"");
+    EXPECT_EQ(jo->getElement("short")->getAsString(), "abc");
+    EXPECT_EQ(jo->getElement("escaped")->getAsString(), "line\nbreak and more than sixteen bytes");
+    EXPECT_TRUE(jo->getElement("long")->equals(*JString::New(longText)));
+    EXPECT_EQ(jo->getElement("long")->hash(), JString::New(longText)->hash());
+    jo.reset();
+    EXPECT_TRUE(weak.expired());
+
+    EXPECT_THROW(parser.parseZeroCopy(std::make_shared<const std::string>("[\"abc")), ParseError);
+
+    // 普通JString不为引用付出内存
+    EXPECT_EQ(sizeof(JString), sizeof(JElement) + sizeof(std::string));
+}
+
 TEST(Parser, NumberType) {
     JsonParser parser;
     EXPECT_EQ(parser.parse("0")->getAsDouble(), 0.0);
@@ -115,6 +208,61 @@ TEST(Parser, NumberType) {
     EXPECT_THROW(parser.parse("-1e309"), ParseError);
 }
 
+TEST(Parser, LazyNumbers) {
+    JsonParser parser;
+    parser.setLazyNumbers(true);
+    auto ja = parser.parse("[9007199254740993, 1.50, -0, 1E+2, 1e-10000, -9223372036854775808, 2.5]")->getAsArray();
+    EXPECT_EQ(ja->toJson(), "[9007199254740993,1.50,-0,1E+2,1e-10000,-9223372036854775808,2.5]");
+    EXPECT_EQ(ja->getElement(0)->getAsInt64(), 9007199254740993LL);
+    EXPECT_EQ(ja->getElement(1)->getAsDouble(), 1.5);
+    EXPECT_EQ(ja->getElement(3)->getAsInt64(), 100);
+    EXPECT_EQ(ja->getElement(4)->getAsDouble(), 0.0);
+    EXPECT_EQ(ja->getElement(5)->getAsInt64(), INT64_MIN);
+    EXPECT_THROW(ja->getElement(6)->getAsInt64(), std::out_of_range);
+    EXPECT_THROW(parser.parse("18446744073709551616")->getAsInt64(), std::out_of_range);
+    EXPECT_THROW(parser.parse("1e309"), ParseError);
+    EXPECT_THROW(parser.parse("-1E+400"), ParseError);
+    EXPECT_THROW(parser.parse("1" + std::string(309, '0')), ParseError);
+    EXPECT_EQ(parser.parse(std::string(308, '9'))->toJson(), std::string(308, '9'));
+
+    // 超过2^53的整数按原文精确比较
+    EXPECT_FALSE(parser.parse("9007199254740993")->equals(*parser.parse("9007199254740992")));
+    EXPECT_TRUE(parser.parse("100")->equals(*parser.parse("1e2")));
+    // 原文与double之间也按精确值比较，保证传递性
+    auto exactHigh = parser.parse("9007199254740993"), exactLow = parser.parse("9007199254740992");
+    auto rounded = JNumber::New(9007199254740992.0);
+    EXPECT_FALSE(exactHigh->equals(*rounded));
+    EXPECT_TRUE(exactLow->equals(*rounded));
+    EXPECT_TRUE(parser.parse("-0")->equals(*JNumber::New(0.0)));
+    EXPECT_TRUE(parser.parse("2.5")->equals(*JNumber::New(2.5)));
+    EXPECT_TRUE(parser.parse("18446744073709551616")->equals(*JNumber::New(18446744073709551616.0)));
+    // 同一个整数的不同写法精确相等，不经过double
+    EXPECT_TRUE(exactHigh->equals(*parser.parse("9007199254740993.0")));
+    EXPECT_TRUE(exactHigh->equals(*parser.parse("9007199254740993e0")));
+    EXPECT_TRUE(exactHigh->equals(*parser.parse("90071992547409930E-1")));
+    EXPECT_FALSE(exactLow->equals(*parser.parse("9007199254740993.0")));
+    EXPECT_EQ(parser.parse("9007199254740993.000")->getAsInt64(), 9007199254740993LL);
+    EXPECT_EQ(parser.parse("-9.223372036854775808e18")->getAsInt64(), INT64_MIN);
+    EXPECT_EQ(parser.parse("0.0e-5")->getAsInt64(), 0);
+    EXPECT_THROW(parser.parse("9.223372036854775808e18")->getAsInt64(), std::out_of_range);
+    EXPECT_THROW(parser.parse("1e-1")->getAsInt64(), std::out_of_range);
+
+    // 长原文单独分配，零拷贝时引用输入
+    std::string longNumber = "1234567890.12345678901234567890123456789";
+    EXPECT_EQ(parser.parse(longNumber)->toJson(), longNumber);
+    auto zeroCopy = parser.parseZeroCopy(std::make_shared<const std::string>("[" + longNumber + ", 7]"));
+    EXPECT_EQ(zeroCopy->toJson(), "[" + longNumber + ",7]");
+    EXPECT_EQ(zeroCopy->getAsArray()->getElement(1)->getAsInt64(), 7);
+
+    // 不开启时JNumber不为原文付出内存
+    EXPECT_EQ(sizeof(JNumber), sizeof(JElement) + sizeof(double));
+
+    parser.setLazyNumbers(false);
+    EXPECT_EQ(parser.parse("1.50")->toJson(), "1.5");
+    EXPECT_EQ(parser.parse("42")->getAsInt64(), 42);
+    EXPECT_THROW(parser.parse("0.5")->getAsInt64(), std::out_of_range);
+}
+
 TEST(Parser, ArrayType) {
     JsonParser parser;
     auto arr1 = parser.parse("[ null , false , true , 123 , \"abc\" ]")->getAsArray();
@@ -147,6 +295,66 @@ TEST(Parser, ObjectType) {
     EXPECT_EQ(jo->getElement("o")->getAsObject()->getElement("2")->getAsDouble(), 2.0);
 }
 
+TEST(Parser, KeyInterning) {
+    auto table = std::make_shared<JsonKeyTable>();
+    JsonParser p1, p2;
+    p1.setKeyTable(table);
+    p2.setKeyTable(table);
+    auto a = p1.parse("[{\"price\": 1, \"name\": \"x\"}, {\"price\": 2, \"na\\u006de\": \"y\"}]")->getAsArray();
+    auto b = p2.parse("{\"price\": 3}")->getAsObject();
+    EXPECT_EQ(table->size(), 2);
+    EXPECT_EQ(p1.keyTable(), table);
+
+    JKey price = table->intern("price");
+    JKey name = table->intern("name");
+    EXPECT_EQ(&price.str(), &b->pairs().begin()->first.str()); // 共享同一份存储
+    EXPECT_EQ(a->getElement(0)->getAsObject()->getElement(price)->getAsDouble(), 1.0);
+    EXPECT_EQ(a->getElement(1)->getAsObject()->getElement(name)->getAsString(), "y");
+    EXPECT_EQ(a->getElement(1)->getAsObject()->getElement("name")->getAsString(), "y");
+    EXPECT_TRUE(b->hasKey(price));
+    EXPECT_FALSE(b->hasKey(name));
+    EXPECT_THROW(b->getElement(name), std::out_of_range);
+    EXPECT_TRUE(JKey("price") == price);
+
+    // 表满后新key不再驻留，但解析结果不受影响
+    auto small = std::make_shared<JsonKeyTable>(2);
+    JsonParser p3;
+    p3.setKeyTable(small);
+    auto c = p3.parse("{\"k1\": 1, \"k2\": 2, \"k3\": 3, \"k4\": 4}")->getAsObject();
+    EXPECT_EQ(small->size(), 2);
+    EXPECT_EQ(c->getElement("k4")->getAsDouble(), 4.0);
+    EXPECT_THROW(p3.setKeyTable(nullptr), std::invalid_argument);
+
+    std::vector<std::thread> threads;
+    std::vector<JKey> keys(8);
+    for (size_t i = 0; i < keys.size(); i++)
+        threads.emplace_back([&, i] {
+            JsonParser parser;
+            parser.setKeyTable(table);
+            for (int n = 0; n < 1000; n++)
+                parser.parse("{\"shared\": " + std::to_string(n) + ", \"k" + std::to_string(n % 10) + "\": null}");
+            keys[i] = table->intern("shared");
+        });
+    for (auto &t : threads)
+        t.join();
+    for (const auto &key : keys)
+        EXPECT_EQ(&key.str(), &keys[0].str());
+    EXPECT_EQ(table->size(), 13);
+
+    // 被移动后的key是空key，仍可安全使用
+    JKey k("abc");
+    auto obj = JObject::New();
+    obj->addElement(std::move(k), JNull::New());
+    EXPECT_EQ(k.str(), "");
+    EXPECT_TRUE(k == JKey());
+    EXPECT_FALSE(obj->hasKey(k));
+    EXPECT_TRUE(obj->hasKey("abc"));
+    JKey moved("xyz");
+    k = std::move(moved);
+    EXPECT_EQ(k.str(), "xyz");
+    EXPECT_EQ(moved.hash(), JKey().hash());
+}
+
 TEST(Parser, ParseError) {
     JsonParser parser;
     try {
@@ -183,6 +391,560 @@ TEST(Parser, ParseError) {
     }
 }
 
+TEST(Parser, NestingDepth) {
+    JsonParser parser;
+    EXPECT_EQ(parser.maxDepth(), JsonParser::DEFAULT_MAX_DEPTH);
+    std::string deep = std::string(100000, '[') + std::string(100000, ']');
+    EXPECT_THROW(parser.parse(deep), ParseError);
+    deep.clear();
+    for (int i = 0; i < 100000; i++)
+        deep += "{\"a\":";
+    try {
+        parser.parse(deep);
+        FAIL();
+    } catch (ParseError &e) {
+        EXPECT_EQ(std::string(e.what()).substr(0, 16), "nesting too deep");
+    }
+
+    parser.setMaxDepth(3);
+    EXPECT_EQ(parser.parse("[[[1]]]")->toJson(), "[[[1]]]");
+    EXPECT_EQ(parser.parse("{\"a\":[{}]}")->toJson(), "{\"a\":[{}]}");
+    EXPECT_THROW(parser.parse("[[[[1]]]]"), ParseError);
+    EXPECT_THROW(parser.parse("{\"a\":{\"b\":{\"c\":{}}}}"), ParseError);
+    try {
+        parser.parse("[[[[]]]]");
+    } catch (ParseError &e) {
+        EXPECT_EQ(std::string(e.what()).substr(0, 16), "nesting too deep");
+    }
+
+    parser.setMaxDepth(JsonParser::DEFAULT_MAX_DEPTH);
+    auto ja = parser.parse("[[1, [2, {\"k\": [3]}]], {}, []]")->getAsArray();
+    EXPECT_EQ(ja->size(), 3);
+    EXPECT_EQ(ja->getElement(0)->getAsArray()->getElement(1)->getAsArray()->getElement(1)->getAsObject()
+                  ->getElement("k")->getAsArray()->getElement(0)->getAsDouble(), 3.0);
+    EXPECT_THROW(parser.parse("[1, [2, 3]"), ParseError);
+    EXPECT_THROW(parser.parse("{\"a\": [1}"), ParseError);
+    EXPECT_THROW(parser.parse("[1,]"), ParseError);
+}
+
+TEST(Parser, Utf8Validation) {
+    JsonParser parser;
+    EXPECT_EQ(parser.parse("\"\xE4\xBD\xA0\xE5\xA5\xBD, world\"")->getAsString(), "\xE4\xBD\xA0\xE5\xA5\xBD, world");
+    EXPECT_EQ(parser.parse("\"\xF0\x9D\x84\x9E\"")->getAsString(), "\xF0\x9D\x84\x9E");
+    EXPECT_THROW(parser.parse("\"\x80\""), ParseError);                 // 孤立的后续字节
+    EXPECT_THROW(parser.parse("\"\xC0\xAF\""), ParseError);             // 过长编码
+    EXPECT_THROW(parser.parse("\"\xED\xA0\x80\""), ParseError);         // 代理区
+    EXPECT_THROW(parser.parse("\"\xF4\x90\x80\x80\""), ParseError);     // 超出U+10FFFF
+    EXPECT_THROW(parser.parse("\"abcdefghijklmnopqrstuvwxyz\xE4\xBD\""), ParseError); // 截断的序列
+    EXPECT_THROW(parser.parse("[\"ok\", \"abcdefghijklmnop\xFF\"]"), ParseError);
+}
+
+TEST(Parser, Validate) {
+    JsonParser parser;
+    EXPECT_TRUE(parser.isValid("{\"a\": [1, 2.5e3, -0, \"x\\u00A2\", true, false, null], \"b\": {}}"));
+    EXPECT_TRUE(parser.isValid(" \"\xE4\xBD\xA0\xE5\xA5\xBD\" "));
+    EXPECT_TRUE(parser.isValid("1e309")); // 只校验语法，不转换数字
+    EXPECT_FALSE(parser.isValid(""));
+    EXPECT_FALSE(parser.isValid("[1, 2"));
+    EXPECT_FALSE(parser.isValid("{\"a\" 1}"));
+    EXPECT_FALSE(parser.isValid("[1,]"));
+    EXPECT_FALSE(parser.isValid("nul"));
+    EXPECT_FALSE(parser.isValid("\"abc"));
+    EXPECT_FALSE(parser.isValid("\"\\uD834\""));
+    EXPECT_FALSE(parser.isValid("\"\xC3\x28\""));
+    EXPECT_FALSE(parser.isValid("[] []"));
+    EXPECT_THROW(parser.validate(std::string(1000, '[') + std::string(1000, ']')), ParseError);
+
+    // 输入不要求以'\0'结尾
+    std::string_view sv("[1, 2]junk", 6);
+    EXPECT_TRUE(parser.isValid(sv));
+    EXPECT_FALSE(parser.isValid(std::string_view("[1, 2]", 5)));
+    EXPECT_FALSE(parser.isValid(std::string_view("truex", 3)));
+    EXPECT_EQ(parser.parse("123456", 3)->getAsDouble(), 123.0);
+    EXPECT_THROW(parser.parse("\"abc\"", 4), ParseError);
+
+    // isValid不生成错误信息，之后的validate仍给出完整信息
+    EXPECT_FALSE(parser.isValid("[1, x]"));
+    try {
+        parser.validate("[1, x]");
+        FAIL();
+    } catch (ParseError &e) {
+        EXPECT_NE(std::string(e.what()).find("[1, x]"), std::string::npos);
+    }
+}
+
+TEST(Parser, Schema) {
+    auto schema = JsonSchema::compile("{"
+                                      "  \"type\": \"object\","
+                                      "  \"required\": [\"id\", \"tags\"],"
+                                      "  \"properties\": {"
+                                      "    \"id\": {\"type\": \"integer\", \"minimum\": 1},"
+                                      "    \"name\": {\"type\": \"string\", \"maxLength\": 4},"
+                                      "    \"level\": {\"enum\": [\"low\", \"high\", null]},"
+                                      "    \"score\": {\"type\": [\"number\", \"null\"], \"maximum\": 100},"
+                                      "    \"tags\": {\"type\": \"array\", \"items\": {\"type\": \"string\"}},"
+                                      "    \"extra\": false"
+                                      "  }"
+                                      "}");
+    JsonParser parser;
+    auto jo = parser.parse("{\"id\": 7, \"name\": \"\xE7\x99\xBD\xE8\x8F\x9C\", \"level\": \"h\\u0069gh\", "
+                           "\"score\": null, \"tags\": [\"a\", \"b\"], \"other\": {\"x\": [1]}}", schema)->getAsObject();
+    EXPECT_EQ(jo->getElement("id")->getAsDouble(), 7.0);
+    EXPECT_EQ(jo->getElement("level")->getAsString(), "high");
+    EXPECT_NO_THROW(parser.validate("{\"tags\": [], \"id\": 1.0, \"score\": 99.5}", schema));
+
+    EXPECT_THROW(parser.parse("[]", schema), ParseError);
+    EXPECT_THROW(parser.validate("{\"id\": 7}", schema), ParseError);
+    EXPECT_THROW(parser.validate("{\"id\": 1.5, \"tags\": []}", schema), ParseError);
+    EXPECT_THROW(parser.validate("{\"id\": 0, \"tags\": []}", schema), ParseError);
+    EXPECT_THROW(parser.validate("{\"id\": 1, \"tags\": [\"a\", 2]}", schema), ParseError);
+    EXPECT_THROW(parser.validate("{\"id\": 1, \"tags\": [], \"name\": \"abcde\"}", schema), ParseError);
+    EXPECT_THROW(parser.validate("{\"id\": 1, \"tags\": [], \"level\": \"mid\"}", schema), ParseError);
+    EXPECT_THROW(parser.validate("{\"id\": 1, \"tags\": [], \"score\": 101}", schema), ParseError);
+    EXPECT_THROW(parser.validate("{\"id\": 1, \"tags\": [], \"extra\": 0}", schema), ParseError);
+    try {
+        parser.validate("{\"tags\": []}", schema);
+        FAIL();
+    } catch (ParseError &e) {
+        EXPECT_EQ(std::string(e.what()).substr(0, 40), "schema mismatch (required key \"id\" missi");
+    }
+
+    EXPECT_THROW(JsonSchema::compile("{\"type\": \"decimal\"}"), std::invalid_argument);
+    EXPECT_THROW(JsonSchema::compile("{\"enum\": [[1]]}"), std::invalid_argument);
+    EXPECT_THROW(JsonSchema::compile("[]"), std::invalid_argument);
+}
+
+TEST(Formatter, MinifyAndPrettify) {
+    JsonParser parser;
+    std::string json = " { \"z\" : [ 1.50 , -0 , 1E+2 , { } , [ ] ] ,\n\t\"a\\u0041\" : { \"n\" : null ,"
+                       " \"t\" : [ true , false ] } , \"s\" : \"\xE7\x99\xBD \\\" \" } ";
+    EXPECT_EQ(parser.minify(json),
+              "{\"z\":[1.50,-0,1E+2,{},[]],\"a\\u0041\":{\"n\":null,\"t\":[true,false]},\"s\":\"\xE7\x99\xBD \\\" \"}");
+    EXPECT_EQ(parser.prettify(json, 2),
+              "{\n"
+              "  \"z\": [\n"
+              "    1.50,\n"
+              "    -0,\n"
+              "    1E+2,\n"
+              "    {},\n"
+              "    []\n"
+              "  ],\n"
+              "  \"a\\u0041\": {\n"
+              "    \"n\": null,\n"
+              "    \"t\": [\n"
+              "      true,\n"
+              "      false\n"
+              "    ]\n"
+              "  },\n"
+              "  \"s\": \"\xE7\x99\xBD \\\" \"\n"
+              "}");
+    EXPECT_EQ(parser.minify(parser.prettify(json)), parser.minify(json));
+    EXPECT_EQ(parser.prettify(" 12 "), "12");
+    EXPECT_EQ(parser.prettify("[]"), "[]");
+    EXPECT_THROW(parser.minify("[1, 2"), ParseError);
+
+    std::string big = "[";
+    for (int i = 0; i < 20000; i++)
+        big += (i ? " , " : " ") + std::string("{ \"k\" : ") + std::to_string(i) + " }";
+    big += " ]";
+    std::ostringstream os;
+    parser.format(big, os);
+    EXPECT_EQ(os.str(), parser.minify(big));
+    EXPECT_EQ(parser.parse(os.str())->getAsArray()->size(), 20000);
+}
+
+TEST(Parser, Columns) {
+    JsonParser parser;
+    using T = JsonColumns::Type;
+    auto table = parser.parseColumns("[{\"id\": 9007199254740993, \"price\": 1.5, \"name\": \"a\\u0042\", \"ok\": true, \"skip\": {\"x\": [1]}},"
+                                     " {\"price\": 2, \"id\": -1, \"name\": \"\", \"ok\": null},"
+                                     " {\"name\": \"\xE7\x99\xBD\", \"skip\": [], \"price\": null}]",
+                                     {{"id", T::INT64}, {"price", T::DOUBLE}, {"name", T::STRING}, {"ok", T::BOOLEAN}});
+    EXPECT_EQ(table.rows, 3);
+    const auto &id = table.column("id");
+    EXPECT_EQ(id.ints, (std::vector<int64_t>{9007199254740993LL, -1, 0}));
+    EXPECT_FALSE(id.isNull(1));
+    EXPECT_TRUE(id.isNull(2));
+    const auto &price = table.column("price");
+    EXPECT_EQ(price.doubles, (std::vector<double>{1.5, 2, 0}));
+    EXPECT_TRUE(price.isNull(2));
+    const auto &name = table.column("name");
+    EXPECT_EQ(name.getString(0), "aB");
+    EXPECT_EQ(name.getString(1), "");
+    EXPECT_EQ(name.getString(2), "\xE7\x99\xBD");
+    EXPECT_FALSE(name.isNull(1));
+    const auto &ok = table.column("ok");
+    EXPECT_EQ(ok.booleans[0], 1);
+    EXPECT_TRUE(ok.isNull(1));
+    EXPECT_TRUE(ok.isNull(2));
+    for (const auto &column : table.columns)
+        EXPECT_EQ(column.nullBitmap.size(), 1);
+    EXPECT_THROW(table.column("skip"), std::out_of_range);
+
+    EXPECT_EQ(parser.parseColumns("[]", {{"id", T::INT64}}).rows, 0);
+    EXPECT_THROW(parser.parseColumns("{}", {{"id", T::INT64}}), ParseError);
+    EXPECT_THROW(parser.parseColumns("[1]", {{"id", T::INT64}}), ParseError);
+    EXPECT_THROW(parser.parseColumns("[{\"id\": 1.5}]", {{"id", T::INT64}}), ParseError);
+    EXPECT_THROW(parser.parseColumns("[{\"id\": \"1\"}]", {{"id", T::INT64}}), ParseError);
+    EXPECT_THROW(parser.parseColumns("[{\"id\": [1]}]", {{"id", T::DOUBLE}}), ParseError);
+    EXPECT_THROW(parser.parseColumns("[{\"id\": 1, \"id\": 2}]", {{"id", T::DOUBLE}}), ParseError);
+    EXPECT_THROW(parser.parseColumns("[{\"id\": 99999999999999999999}]", {{"id", T::INT64}}), ParseError);
+}
+
+TEST(Parser, Stream) {
+    JsonParser parser;
+    std::string json = " [ {\"id\": 1, \"s\": \"a]\\\"}\"}, [1, [2]] ,\"x,y\", 12.5, true, null, {} ] ";
+    std::vector<std::string> expected{"{\"s\":\"a]\"}\",\"id\":1}", "[1,[2]]", "\"x,y\"", "12.5", "true", "null", "{}"};
+    for (size_t chunk : {1, 3, 64}) {
+        std::istringstream in(json);
+        std::vector<std::string> got;
+        for (const auto &e : parser.stream(in, chunk))
+            got.push_back(e->toJson());
+        ASSERT_EQ(got.size(), expected.size());
+        EXPECT_EQ(got[1], expected[1]);
+        EXPECT_EQ(got[2], expected[2]);
+        EXPECT_EQ(got[3], expected[3]);
+        EXPECT_EQ(got[6], expected[6]);
+    }
+
+    std::istringstream ndjson("{\"a\": 1}\n{\"a\": 2}\n\n3 \"s\"[]\n");
+    size_t count = 0;
+    for (const auto &e : parser.stream(ndjson, 4)) {
+        if (count < 2) {
+            EXPECT_EQ(e->getAsObject()->getElement("a")->getAsDouble(), count + 1);
+        }
+        count++;
+    }
+    EXPECT_EQ(count, 5);
+
+    std::istringstream empty("  ");
+    auto s = parser.stream(empty);
+    EXPECT_TRUE(s.begin() == s.end());
+    std::istringstream emptyArray("[ ]");
+    auto s2 = parser.stream(emptyArray);
+    EXPECT_TRUE(s2.begin() == s2.end());
+
+    auto consume = [&parser](const std::string &str) {
+        std::istringstream in(str);
+        size_t n = 0;
+        for (const auto &e : parser.stream(in, 2))
+            n += e != nullptr;
+        return n;
+    };
+    EXPECT_THROW(consume("[1, 2"), ParseError);
+    EXPECT_THROW(consume("[1 2]"), ParseError);
+    EXPECT_THROW(consume("[1, {\"a\" 1}]"), ParseError);
+    EXPECT_THROW(consume("[1] x"), ParseError);
+    EXPECT_THROW(consume("[1,]"), ParseError);
+    EXPECT_THROW(consume("{\"a\": 1"), ParseError);
+
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    std::string piped = "[\"pipe\", 2]";
+    ASSERT_EQ(write(fds[1], piped.data(), piped.size()), static_cast<ssize_t>(piped.size()));
+    close(fds[1]);
+    std::vector<std::string> fromFd;
+    for (const auto &e : parser.stream(fds[0], 3))
+        fromFd.push_back(e->toJson());
+    close(fds[0]);
+    EXPECT_EQ(fromFd, (std::vector<std::string>{"\"pipe\"", "2"}));
+
+    // 元素在异常之前已逐个产出
+    std::istringstream partial("[1, 2, x]");
+    std::vector<double> numbers;
+    try {
+        for (const auto &e : parser.stream(partial, 1))
+            numbers.push_back(e->getAsDouble());
+    } catch (ParseError &) {
+    }
+    EXPECT_EQ(numbers, (std::vector<double>{1, 2}));
+}
+
+TEST(Parser, StreamGzip) {
+    auto gzip = [](const std::string &str) {
+        z_stream zs{};
+        deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        std::string out(deflateBound(&zs, str.size()) + 32, '\0');
+        zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(str.data()));
+        zs.avail_in = str.size();
+        zs.next_out = reinterpret_cast<Bytef *>(out.data());
+        zs.avail_out = out.size();
+        deflate(&zs, Z_FINISH);
+        out.resize(zs.total_out);
+        deflateEnd(&zs);
+        return out;
+    };
+    std::string json = "[";
+    for (int i = 0; i < 20000; i++)
+        json += (i ? "," : "") + std::string("{\"id\":") + std::to_string(i) + ",\"name\":\"item" + std::to_string(i) + "\"}";
+    json += "]";
+    std::string compressed = gzip(json);
+
+    JsonParser parser;
+    for (size_t chunk : {7, 4096}) {
+        std::istringstream in(compressed);
+        int64_t expectedId = 0;
+        for (const auto &e : parser.streamGzip(in, chunk, 2)) {
+            EXPECT_EQ(e->getAsObject()->getElement("id")->getAsInt64(), expectedId);
+            expectedId++;
+        }
+        EXPECT_EQ(expectedId, 20000);
+    }
+
+    // 多个gzip member首尾相接，按文件路径读取
+    std::string path = "/tmp/json_parser_stream_gzip_test.json.gz";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << gzip("{\"a\": 1}\n") << gzip("[2, 3]\n");
+    }
+    std::vector<std::string> got;
+    for (const auto &e : parser.streamGzip(path, 16))
+        got.push_back(e->toJson());
+    EXPECT_EQ(got, (std::vector<std::string>{"{\"a\":1}", "[2,3]"}));
+    std::remove(path.c_str());
+    EXPECT_THROW(parser.streamGzip(path), std::system_error);
+
+    auto consume = [&parser](const std::string &data) {
+        std::istringstream in(data);
+        size_t n = 0;
+        for (const auto &e : parser.streamGzip(in, 64))
+            n += e != nullptr;
+        return n;
+    };
+    EXPECT_THROW(consume(compressed.substr(0, compressed.size() / 2)), std::runtime_error);
+    std::string corrupted = compressed;
+    corrupted[corrupted.size() / 2] ^= 0x5a;
+    EXPECT_ANY_THROW(consume(corrupted));
+    EXPECT_THROW(consume("not gzip at all"), std::runtime_error);
+    EXPECT_THROW(consume(gzip("[1, 2")), ParseError);
+
+    // 提前退出时后台线程应随流一起结束，不会卡住
+    std::istringstream in(compressed);
+    size_t n = 0;
+    for ([[maybe_unused]] const auto &e : parser.streamGzip(in, 64, 2)) {
+        if (++n == 3)
+            break;
+    }
+    EXPECT_EQ(n, 3);
+}
+
+TEST(Parser, DocumentCache) {
+    JsonDocumentCache cache;
+    std::string json = "{\"name\": \"a string longer than the inline buffer\", \"list\": [1, 2.5, true, null]}";
+    auto first = cache.parse(json);
+    auto second = cache.parse(std::string(json));
+    EXPECT_EQ(first, second);
+    EXPECT_EQ(first->getAsObject()->getElement("name")->getAsString(), "a string longer than the inline buffer");
+    auto stats = cache.stats();
+    EXPECT_EQ(stats.hits, 1);
+    EXPECT_EQ(stats.misses, 1);
+    EXPECT_EQ(stats.entries, 1);
+    EXPECT_GT(stats.bytes, json.size());
+
+    // 内容不同的文档不会命中
+    auto other = cache.parse(json + " ");
+    EXPECT_NE(other, first);
+    EXPECT_TRUE(other->equals(*first));
+    EXPECT_THROW(cache.parse("{\"a\": "), ParseError);
+    EXPECT_EQ(cache.stats().entries, 2);
+
+    // 超出容量时淘汰最久未使用的文档
+    JsonDocumentCache small(stats.bytes * 2 + stats.bytes / 2);
+    auto a = small.parse(json);
+    small.parse(json + " ");
+    EXPECT_EQ(small.parse(json), a); // a成为最近使用
+    small.parse(json + "  ");
+    EXPECT_EQ(small.stats().evictions, 1);
+    EXPECT_EQ(small.stats().entries, 2);
+    EXPECT_EQ(small.parse(json), a);
+    small.parse(json + " ");
+    EXPECT_EQ(small.stats().misses, 4);
+    EXPECT_LE(small.stats().bytes, small.capacity());
+
+    // 单个文档超过容量时照常解析但不缓存
+    JsonDocumentCache tiny(16);
+    EXPECT_EQ(tiny.parse(json)->getAsObject()->getElement("list")->getAsArray()->size(), 4);
+    EXPECT_EQ(tiny.stats().entries, 0);
+
+    cache.clear();
+    EXPECT_EQ(cache.stats().entries, 0);
+    EXPECT_EQ(cache.stats().bytes, 0);
+    EXPECT_NE(cache.parse(json), first);
+
+    std::vector<std::thread> threads;
+    std::vector<std::shared_ptr<JElement>> results(4);
+    for (size_t i = 0; i < results.size(); i++)
+        threads.emplace_back([&, i] {
+            for (int j = 0; j < 100; j++)
+                results[i] = cache.parse(json);
+        });
+    for (auto &t : threads)
+        t.join();
+    for (auto &r : results)
+        EXPECT_EQ(r, results[0]);
+    EXPECT_EQ(cache.stats().hits + cache.stats().misses, 405); // 计数不随clear清零
+
+    // 共享的文档可以在多个线程中并发计算哈希
+    auto shared = cache.parse(json);
+    std::vector<uint64_t> hashes(4);
+    threads.clear();
+    for (size_t i = 0; i < hashes.size(); i++)
+        threads.emplace_back([&, i] {
+            std::unordered_set<std::shared_ptr<JElement>, JElementHash, JElementEqual> set;
+            for (int j = 0; j < 100; j++)
+                set.insert(cache.parse(json));
+            hashes[i] = shared->hash(true);
+        });
+    for (auto &t : threads)
+        t.join();
+    for (auto h : hashes)
+        EXPECT_EQ(h, JsonParser().parse(json)->hash());
+
+    // null、true、false同样是独立分配的节点，需要计入估算
+    std::string literals = "[null";
+    for (int i = 1; i < 1000; i++)
+        literals += ",null";
+    literals += "]";
+    JsonDocumentCache literalCache;
+    literalCache.parse(literals);
+    EXPECT_GE(literalCache.stats().bytes, 1000 * sizeof(JNull) + 1000 * sizeof(std::shared_ptr<JElement>));
+}
+
+TEST(Renderer, ReplaceAndRemove) {
+    auto object = JObject::New();
+    object->addElement("a", JNumber::New(1));
+    object->addElement("a", JNumber::New(2));
+    object->setElement("a", JNumber::New(3));
+    EXPECT_EQ(object->size(), 1);
+    EXPECT_EQ(object->getElement("a")->getAsDouble(), 3);
+    object->setElement("b", JNull::New());
+    EXPECT_EQ(object->removeElement("b"), 1);
+    EXPECT_EQ(object->removeElement("b"), 0);
+    EXPECT_EQ(object->toJson(), "{\"a\":3}");
+
+    auto array = JArray::New();
+    array->insertElement(0, JNumber::New(2));
+    array->insertElement(0, JNumber::New(1));
+    array->insertElement(2, JNumber::New(3));
+    EXPECT_EQ(array->toJson(), "[1,2,3]");
+    EXPECT_THROW(array->insertElement(4, JNull::New()), std::out_of_range);
+
+    // 修改使缓存的哈希失效
+    uint64_t h = array->hash(true);
+    array->insertElement(1, JNull::New());
+    EXPECT_NE(array->hash(true), h);
+}
+
+TEST(Patch, Apply) {
+    JsonParser parser;
+    auto doc = parser.parse(R"({"foo": ["bar", "baz"], "a/b": 1, "m~n": {"x": 2}})");
+    auto patch = parser.parse(R"([
+        {"op": "test", "path": "/foo/1", "value": "baz"},
+        {"op": "add", "path": "/foo/1", "value": "qux"},
+        {"op": "add", "path": "/foo/-", "value": {"deep": [1]}},
+        {"op": "remove", "path": "/foo/0"},
+        {"op": "replace", "path": "/a~1b", "value": 42},
+        {"op": "copy", "from": "/foo/2", "path": "/copied"},
+        {"op": "move", "from": "/m~0n/x", "path": "/moved"},
+        {"op": "add", "path": "/copied/deep/0", "value": 0}
+    ])");
+    auto result = JsonPatch::apply(doc, *patch);
+    EXPECT_EQ(result, doc);
+    auto expected = parser.parse(R"({"foo": ["qux", "baz", {"deep": [1]}], "a/b": 42, "m~n": {},
+        "copied": {"deep": [0, 1]}, "moved": 2})");
+    EXPECT_TRUE(doc->equals(*expected)) << doc->toJson();
+
+    // 值从patch中复制，修改文档不影响patch
+    EXPECT_EQ(patch->getAsArray()->getElement(2)->getAsObject()->getElement("value")->toJson(), "{\"deep\":[1]}");
+
+    // 路径上缓存的哈希随修改失效
+    doc->hash(true);
+    JsonPatch::apply(doc, *parser.parse(R"([{"op": "replace", "path": "/m~0n", "value": 1}])"));
+    expected->getAsObject()->setElement("m~n", JNumber::New(1));
+    EXPECT_EQ(doc->hash(true), expected->hash());
+
+    auto root = JsonPatch::apply(doc, *parser.parse(R"([{"op": "replace", "path": "", "value": [1]}])"));
+    EXPECT_EQ(root->toJson(), "[1]");
+
+    auto fails = [&](const std::string &ops) {
+        JsonPatch::apply(parser.parse(R"({"a": {"b": [1, 2]}})"), *parser.parse(ops));
+    };
+    EXPECT_THROW(fails(R"([{"op": "remove", "path": "/x"}])"), std::out_of_range);
+    EXPECT_THROW(fails(R"([{"op": "replace", "path": "/a/c", "value": 1}])"), std::out_of_range);
+    EXPECT_THROW(fails(R"([{"op": "add", "path": "/a/b/3", "value": 1}])"), std::out_of_range);
+    EXPECT_THROW(fails(R"([{"op": "add", "path": "/a/b/01", "value": 1}])"), std::invalid_argument);
+    EXPECT_THROW(fails(R"([{"op": "add", "path": "a", "value": 1}])"), std::invalid_argument);
+    EXPECT_THROW(fails(R"([{"op": "add", "path": "/a~2", "value": 1}])"), std::invalid_argument);
+    EXPECT_THROW(fails(R"([{"op": "add", "path": "/a"}])"), std::invalid_argument);
+    EXPECT_THROW(fails(R"([{"op": "frobnicate", "path": "/a"}])"), std::invalid_argument);
+    EXPECT_THROW(fails(R"([{"op": "move", "from": "/a", "path": "/a/b/0"}])"), std::invalid_argument);
+    EXPECT_THROW(fails(R"([{"op": "test", "path": "/a/b", "value": [2, 1]}])"), std::runtime_error);
+    EXPECT_THROW(fails(R"({"op": "remove", "path": "/a"})"), std::invalid_argument);
+}
+
+TEST(Patch, MergePatch) {
+    JsonParser parser;
+    // RFC 7386 中的示例
+    auto doc = parser.parse(R"({"title": "Goodbye!", "author": {"givenName": "John", "familyName": "Doe"},
+        "tags": ["example", "sample"], "content": "This will be unchanged"})");
+    auto patch = parser.parse(R"({"title": "Hello!", "phoneNumber": "+01-123-456-7890",
+        "author": {"familyName": null}, "tags": ["example"]})");
+    auto result = JsonPatch::mergePatch(doc, *patch);
+    EXPECT_EQ(result, doc);
+    EXPECT_TRUE(doc->equals(*parser.parse(R"({"title": "Hello!", "author": {"givenName": "John"},
+        "tags": ["example"], "content": "This will be unchanged", "phoneNumber": "+01-123-456-7890"})")));
+
+    EXPECT_EQ(JsonPatch::mergePatch(parser.parse(R"({"a": "b"})"), *parser.parse(R"({"a": {"b": "c"}})"))->toJson(),
+              "{\"a\":{\"b\":\"c\"}}");
+    EXPECT_EQ(JsonPatch::mergePatch(parser.parse(R"({"a": [1]})"), *parser.parse("[2]"))->toJson(), "[2]");
+    EXPECT_EQ(JsonPatch::mergePatch(parser.parse("[1]"), *parser.parse(R"({"a": {"b": null}})"))->toJson(),
+              "{\"a\":{}}");
+}
+
+TEST(Patch, Diff) {
+    JsonParser parser;
+    std::vector<std::pair<std::string, std::string>> cases{
+            {R"({"a": 1, "b": [1, 2, 3, 4], "c": {"d": "x"}, "e/~": 0})",
+             R"({"a": 2, "b": [1, 5, 3, 4, 6, 7], "c": {"d": "x"}, "f": null})"},
+            {"[1, 2, 3, 4, 5]", "[1, 5]"},
+            {"[1, 2]", "[0, 1, 2]"},
+            {"[]", "[[1], {}]"},
+            {R"({"a": [1]})", "[1]"},
+            {"1", "1.0"},
+    };
+    for (auto &[from, to] : cases) {
+        auto a = parser.parse(from), b = parser.parse(to);
+        auto ops = JsonPatch::diff(a, b);
+        auto patched = JsonPatch::apply(a, *ops);
+        EXPECT_TRUE(patched->equals(*b)) << from << " -> " << patched->toJson() << " via " << ops->toJson();
+    }
+
+    // 相同的子树被跳过，只产生实际变化的操作
+    auto a = parser.parse(R"({"big": [1, 2, {"x": [3]}], "v": 1})");
+    auto b = parser.parse(R"({"big": [1, 2, {"x": [3]}], "v": 2})");
+    auto ops = JsonPatch::diff(a, b);
+    ASSERT_EQ(ops->size(), 1);
+    EXPECT_EQ(ops->at(0)->getAsObject()->getElement("path")->getAsString(), "/v");
+    EXPECT_EQ(ops->at(0)->getAsObject()->getElement("op")->getAsString(), "replace");
+    EXPECT_EQ(JsonPatch::diff(a, parser.parse(R"({"v": 1, "big": [1, 2, {"x": [3]}]})"))->size(), 0);
+
+    ops = JsonPatch::diff(parser.parse("[0, 1, 2, 3]"), parser.parse("[0, 3]"));
+    EXPECT_EQ(ops->toJson().find("\"replace\""), std::string::npos);
+
+    // diff不在树中留下缓存的哈希，之后经子节点的修改不影响equals
+    auto x = parser.parse(R"({"x": {"l": [1]}, "y": 1})");
+    auto y = parser.parse(R"({"x": {"l": [1]}, "y": 2})");
+    JsonPatch::diff(x, y);
+    x->getAsObject()->getElement("x")->getAsObject()->getElement("l")->getAsArray()->addElement(JNumber::New(2));
+    EXPECT_TRUE(x->equals(*parser.parse(R"({"x": {"l": [1, 2]}, "y": 1})")));
+
+    auto duplicated = parser.parse(R"({"a": 1, "a": 2})");
+    EXPECT_THROW(JsonPatch::diff(duplicated, parser.parse(R"({"a": 1})")), std::invalid_argument);
+    EXPECT_THROW(JsonPatch::diff(parser.parse(R"({"o": {}})"), parser.parse(R"({"o": {"b": 1, "b": 1}})")),
+                 std::invalid_argument);
+    EXPECT_EQ(JsonPatch::diff(duplicated, parser.parse(R"({"a": 2, "a": 1})"))->size(), 0);
+}
+
 int main(int argc, char **argv) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();